@@ -0,0 +1,102 @@
+#include "bench_util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static volatile uint64_t alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+uint64_t bench_alloc_count() {
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int bench_counter_open() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;           // count threads spawned by the benchmark too
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    
+    long fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    return fd < 0 ? -1 : (int)fd;
+}
+
+void bench_counter_start(int fd) {
+    if(fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+long long bench_counter_stop(int fd) {
+    if(fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long count = 0;
+    if(read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return count;
+}
+
+FILE *bench_results_stream() {
+    static FILE *out = NULL;
+    if(out) return out;
+    
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if(saved < 0 || devnull < 0) {
+        out = stdout;
+        return out;
+    }
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    out = fdopen(saved, "w");
+    if(!out) out = stderr;
+    setvbuf(out, NULL, _IOLBF, 0);
+    return out;
+}
+
+void bench_report(FILE *out, const char *name, uint64_t ops, uint64_t ns,
+                  uint64_t allocs, long long misses) {
+    if(ops == 0) ops = 1;
+    if(misses >= 0) {
+        fprintf(out, "%-30s %12llu ops %10.1f ns/op %8.2f allocs/op %10.2f misses/op\n",
+                name, (unsigned long long)ops, (double)ns / ops,
+                (double)allocs / ops, (double)misses / ops);
+    } else {
+        fprintf(out, "%-30s %12llu ops %10.1f ns/op %8.2f allocs/op %10s misses/op\n",
+                name, (unsigned long long)ops, (double)ns / ops,
+                (double)allocs / ops, "n/a");
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+// Shared helpers for the parser and cache microbenchmarks
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Monotonic clock in nanoseconds
+uint64_t bench_now_ns();
+
+// Allocation counter fed by the --wrap=malloc/calloc/realloc shims
+uint64_t bench_alloc_count();
+
+// Hardware cache-miss counter (perf_event_open); -1 when unavailable
+int bench_counter_open();
+void bench_counter_start(int fd);
+long long bench_counter_stop(int fd);
+
+// Results go to the real stdout; fd 1 is pointed at /dev/null so the
+// proxy's own logging does not end up on the terminal
+FILE *bench_results_stream();
+
+// One result row: ops, elapsed ns, allocations, cache misses (-1 = n/a)
+void bench_report(FILE *out, const char *name, uint64_t ops, uint64_t ns,
+                  uint64_t allocs, long long misses);
+
+#endif // BENCH_UTIL_H
@@ -0,0 +1,171 @@
+// Microbenchmark for the proxy cache: find / add_cache_element /
+// remove_cache_element
+//
+// Usage: cache_bench [-k keys] [-s object_size] [-t threads] [-n ops_per_thread]
+//                    [-r find_percent]
+
+#include "../proxy_cache.h"
+#include "bench_util.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define KEY_LEN 256
+
+static int key_count = 1000;
+static int object_size = 4096;
+static int thread_count = 4;
+static long ops_per_thread = 20000;
+static int find_percent = 90;
+
+static char *payload;
+static pthread_barrier_t barrier;
+
+typedef struct {
+    int id;
+    int mode;
+    uint64_t rng;
+    uint64_t ops;
+    uint64_t ns;
+} worker_arg;
+
+enum { MODE_FIND_HIT, MODE_FIND_MISS, MODE_MIXED };
+
+// Keys look like the absolute URLs the proxy caches under (cache_key())
+static void make_key(char *key, long n) {
+    snprintf(key, KEY_LEN, "http://bench.local/objects/%ld", n);
+}
+
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void *worker(void *p) {
+    worker_arg *arg = (worker_arg*)p;
+    char key[KEY_LEN];
+    long next_new = key_count + (long)arg->id * ops_per_thread;
+    
+    pthread_barrier_wait(&barrier);
+    uint64_t start = bench_now_ns();
+    for(long i = 0; i < ops_per_thread; i++) {
+        uint64_t r = next_rand(&arg->rng);
+        switch(arg->mode) {
+            case MODE_FIND_HIT:
+                make_key(key, (long)(r % key_count));
+                cache_element_release(find(key, "GET"));
+                break;
+            case MODE_FIND_MISS:
+                make_key(key, -1 - (long)(r % key_count));
+                cache_element_release(find(key, "GET"));
+                break;
+            case MODE_MIXED:
+                if((int)(r % 100) < find_percent) {
+                    make_key(key, (long)((r >> 8) % key_count));
+                    cache_element_release(find(key, "GET"));
+                } else {
+                    make_key(key, next_new++);
+                    add_cache_element(payload, object_size, key, "GET");
+                }
+                break;
+        }
+    }
+    arg->ns = bench_now_ns() - start;
+    arg->ops = ops_per_thread;
+    return NULL;
+}
+
+static void run_threads(FILE *out, int counter, const char *name, int mode) {
+    pthread_t threads[thread_count];
+    worker_arg args[thread_count];
+    
+    pthread_barrier_init(&barrier, NULL, thread_count);
+    uint64_t allocs = bench_alloc_count();
+    bench_counter_start(counter);
+    for(int i = 0; i < thread_count; i++) {
+        args[i].id = i;
+        args[i].mode = mode;
+        args[i].rng = 0x9E3779B97F4A7C15ull * (i + 1);
+        pthread_create(&threads[i], NULL, worker, &args[i]);
+    }
+    uint64_t ops = 0, ns = 0;
+    for(int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+        ops += args[i].ops;
+        ns += args[i].ns;
+    }
+    long long misses = bench_counter_stop(counter);
+    bench_report(out, name, ops, ns, bench_alloc_count() - allocs, misses);
+    pthread_barrier_destroy(&barrier);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "k:s:t:n:r:")) != -1) {
+        switch(opt) {
+            case 'k': key_count = atoi(optarg); break;
+            case 's': object_size = atoi(optarg); break;
+            case 't': thread_count = atoi(optarg); break;
+            case 'n': ops_per_thread = atol(optarg); break;
+            case 'r': find_percent = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-k keys] [-s object_size] [-t threads] "
+                        "[-n ops_per_thread] [-r find_percent]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(key_count < 1 || object_size < 1 || thread_count < 1 || ops_per_thread < 1) {
+        fprintf(stderr, "All counts must be positive\n");
+        return 1;
+    }
+    
+    payload = malloc(object_size);
+    if(!payload) return 1;
+    memset(payload, 'x', object_size);
+    
+    FILE *out = bench_results_stream();
+    int counter = bench_counter_open();
+    fprintf(out, "cache_bench: %d keys x %d bytes, %d threads x %ld ops, %d%% find "
+            "(perf counters %s)\n", key_count, object_size, thread_count,
+            ops_per_thread, find_percent, counter < 0 ? "unavailable" : "enabled");
+    
+    // Fill: single-threaded inserts, evicting once past MAX_SIZE
+    char key[KEY_LEN];
+    uint64_t allocs = bench_alloc_count();
+    bench_counter_start(counter);
+    uint64_t start = bench_now_ns();
+    for(int i = 0; i < key_count; i++) {
+        make_key(key, i);
+        add_cache_element(payload, object_size, key, "GET");
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    long long misses = bench_counter_stop(counter);
+    bench_report(out, "add_cache_element", key_count, elapsed,
+                 bench_alloc_count() - allocs, misses);
+    
+    run_threads(out, counter, "find (hit)", MODE_FIND_HIT);
+    run_threads(out, counter, "find (miss)", MODE_FIND_MISS);
+    run_threads(out, counter, "mixed find/add", MODE_MIXED);
+    
+    // Drain: evict everything through the LRU path
+    uint64_t removed = 0;
+    allocs = bench_alloc_count();
+    bench_counter_start(counter);
+    start = bench_now_ns();
+    while(head != NULL) {
+        remove_cache_element();
+        removed++;
+    }
+    elapsed = bench_now_ns() - start;
+    misses = bench_counter_stop(counter);
+    bench_report(out, "remove_cache_element", removed, elapsed,
+                 bench_alloc_count() - allocs, misses);
+    
+    free(payload);
+    if(counter >= 0) close(counter);
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Microbenchmark for ParsedRequest_parse / ParsedRequest_unparse_headers
+//
+// Usage: parser_bench [-f corpus] [-n iterations]
+//
+// The corpus holds raw request captures separated by lines containing
+// only "%%"; LF line endings are converted to CRLF on load.
+
+#include "../proxy_parse.h"
+#include "bench_util.h"
+#include <unistd.h>
+
+#define MAX_CORPUS 1024
+#define UNPARSE_BUF 16384
+
+typedef struct {
+    char *data;
+    int len;
+} corpus_entry;
+
+static corpus_entry corpus[MAX_CORPUS];
+static int corpus_count;
+
+static void add_entry(char *text, size_t len) {
+    while(len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r')) len--;
+    if(len == 0 || corpus_count == MAX_CORPUS) return;
+    
+    // Worst case every byte is a newline, plus the terminating blank line
+    char *out = malloc(len * 2 + 5);
+    if(!out) return;
+    size_t o = 0;
+    for(size_t i = 0; i < len; i++) {
+        if(text[i] == '\r') continue;
+        if(text[i] == '\n') out[o++] = '\r';
+        out[o++] = text[i];
+    }
+    out[o] = '\0';
+    if(!strstr(out, "\r\n\r\n")) {
+        memcpy(out + o, "\r\n\r\n", 5);
+        o += 4;
+    }
+    corpus[corpus_count].data = out;
+    corpus[corpus_count].len = (int)o;
+    corpus_count++;
+}
+
+static int load_corpus(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if(!fp) {
+        perror(path);
+        return -1;
+    }
+    
+    size_t cap = 65536, len = 0;
+    char *text = malloc(cap);
+    char line[8192];
+    while(text && fgets(line, sizeof(line), fp)) {
+        if(strcmp(line, "%%\n") == 0 || strcmp(line, "%%") == 0) {
+            add_entry(text, len);
+            len = 0;
+            continue;
+        }
+        size_t l = strlen(line);
+        if(len + l + 1 > cap) {
+            cap *= 2;
+            text = realloc(text, cap);
+            if(!text) break;
+        }
+        memcpy(text + len, line, l);
+        len += l;
+    }
+    if(text) {
+        add_entry(text, len);
+        free(text);
+    }
+    fclose(fp);
+    return corpus_count > 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "bench/corpus/requests.txt";
+    long iterations = 20000;
+    int opt;
+    
+    while((opt = getopt(argc, argv, "f:n:")) != -1) {
+        switch(opt) {
+            case 'f': path = optarg; break;
+            case 'n': iterations = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-f corpus] [-n iterations]\n", argv[0]);
+                return 1;
+        }
+    }
+    
+    if(load_corpus(path) < 0) {
+        fprintf(stderr, "No requests loaded from %s\n", path);
+        return 1;
+    }
+    
+    FILE *out = bench_results_stream();
+    int counter = bench_counter_open();
+    fprintf(out, "parser_bench: %d requests x %ld iterations (perf counters %s)\n",
+            corpus_count, iterations, counter < 0 ? "unavailable" : "enabled");
+    
+    // Sanity pass so a corpus the parser rejects is obvious in the output
+    int rejected = 0;
+    for(int i = 0; i < corpus_count; i++) {
+        ParsedRequest *pr = ParsedRequest_create();
+        if(ParsedRequest_parse(pr, corpus[i].data, corpus[i].len) < 0) rejected++;
+        ParsedRequest_destroy(pr);
+    }
+    if(rejected) fprintf(out, "warning: %d corpus entries fail to parse\n", rejected);
+    
+    // create + parse + destroy, the full per-request parser cost
+    uint64_t allocs = bench_alloc_count();
+    bench_counter_start(counter);
+    uint64_t start = bench_now_ns();
+    for(long n = 0; n < iterations; n++) {
+        for(int i = 0; i < corpus_count; i++) {
+            ParsedRequest *pr = ParsedRequest_create();
+            ParsedRequest_parse(pr, corpus[i].data, corpus[i].len);
+            ParsedRequest_destroy(pr);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    long long misses = bench_counter_stop(counter);
+    bench_report(out, "ParsedRequest_parse", (uint64_t)iterations * corpus_count,
+                 elapsed, bench_alloc_count() - allocs, misses);
+    
+    // unparse_headers over requests parsed once up front
+    ParsedRequest *parsed[MAX_CORPUS];
+    for(int i = 0; i < corpus_count; i++) {
+        parsed[i] = ParsedRequest_create();
+        ParsedRequest_parse(parsed[i], corpus[i].data, corpus[i].len);
+    }
+    char *buf = malloc(UNPARSE_BUF);
+    allocs = bench_alloc_count();
+    bench_counter_start(counter);
+    start = bench_now_ns();
+    for(long n = 0; n < iterations; n++) {
+        for(int i = 0; i < corpus_count; i++) {
+            ParsedRequest_unparse_headers(parsed[i], buf, UNPARSE_BUF);
+        }
+    }
+    elapsed = bench_now_ns() - start;
+    misses = bench_counter_stop(counter);
+    bench_report(out, "ParsedRequest_unparse_headers", (uint64_t)iterations * corpus_count,
+                 elapsed, bench_alloc_count() - allocs, misses);
+    
+    for(int i = 0; i < corpus_count; i++) {
+        ParsedRequest_destroy(parsed[i]);
+        free(corpus[i].data);
+    }
+    free(buf);
+    if(counter >= 0) close(counter);
+    return 0;
+}
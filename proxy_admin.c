@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include "proxy_admin.h"
+#include "proxy_parse.h"
+#include "proxy_cache.h"
+#include "proxy_tunnel.h"
+#include "proxy_admission.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int admin_socket = -1;
+static int admin_stopping = 0;
+static refresh_fetch_fn admin_fetch;
+
+typedef struct prefetch_run {
+    char **urls;
+    int count;
+    int next;                       // next index to claim
+    int ok;
+    int failed;
+} prefetch_run;
+
+static void admin_reply(int fd, int status, const char *reason, const char *body, size_t len) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.0 %d %s\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                     status, reason, len);
+    send(fd, head, n, MSG_NOSIGNAL);
+    if(len > 0) send(fd, body, len, MSG_NOSIGNAL);
+}
+
+static void admin_reply_text(int fd, int status, const char *reason, const char *text) {
+    admin_reply(fd, status, reason, text, strlen(text));
+}
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    c = tolower((unsigned char)c);
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Look name up in an application/x-www-form-urlencoded string and decode
+// its value into out; returns 0 if found
+static int admin_param(const char *params, const char *name, char *out, size_t out_len) {
+    size_t name_len = strlen(name);
+    
+    for(const char *p = params; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL) {
+        if(strncmp(p, name, name_len) != 0 || p[name_len] != '=') continue;
+        
+        size_t n = 0;
+        for(const char *v = p + name_len + 1; *v && *v != '&' && n + 1 < out_len; v++) {
+            if(*v == '%' && hex_value(v[1]) >= 0 && hex_value(v[2]) >= 0) {
+                out[n++] = (char)(hex_value(v[1]) * 16 + hex_value(v[2]));
+                v += 2;
+            } else {
+                out[n++] = *v == '+' ? ' ' : *v;
+            }
+        }
+        out[n] = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+static void admin_stats(int fd) {
+    cache_stats cs;
+    tunnel_stats ts;
+    admission_stats as;
+    cache_get_stats(&cs);
+    tunnel_get_stats(&ts);
+    admission_get_stats(&as);
+    
+    char body[1024];
+    long long lookups = cs.hits + cs.misses;
+    int n = snprintf(body, sizeof(body),
+                     "cache_entries %ld\ncache_bytes %ld\ncache_max_bytes %ld\n"
+                     "cache_hits %lld\ncache_misses %lld\ncache_hit_ratio %.3f\n"
+                     "cache_inserts %lld\ncache_evictions %lld\ncache_purged %lld\n"
+                     "tunnels_active %ld\ntunnels_total %ld\n"
+                     "tunnel_bytes_up %lld\ntunnel_bytes_down %lld\n"
+                     "admitted %lld\nlimited_rate %lld\nlimited_active %lld\n"
+                     "shed_accept %lld\nshed_queue %lld\noverloaded %d\n",
+                     cs.entries, cs.bytes, cs.max_bytes,
+                     cs.hits, cs.misses, lookups ? (double)cs.hits / lookups : 0.0,
+                     cs.inserts, cs.evictions, cs.purged,
+                     ts.active, ts.total, ts.bytes_up, ts.bytes_down,
+                     as.admitted, as.limited_rate, as.limited_active,
+                     as.shed_accept, as.shed_queue, as.overloaded);
+    admin_reply(fd, 200, "OK", body, n);
+}
+
+static void admin_entries(int fd, const char *query) {
+    char value[16];
+    int max = 20, sort = CACHE_SORT_HITS;
+    if(admin_param(query, "n", value, sizeof(value)) == 0) max = atoi(value);
+    if(max < 1) max = 1;
+    if(max > ADMIN_MAX_ENTRIES) max = ADMIN_MAX_ENTRIES;
+    if(admin_param(query, "sort", value, sizeof(value)) == 0) {
+        if(!strcmp(value, "size")) sort = CACHE_SORT_SIZE;
+        else if(!strcmp(value, "age")) sort = CACHE_SORT_AGE;
+    }
+    
+    cache_entry_info *entries = (cache_entry_info*)malloc(max * sizeof(cache_entry_info));
+    if(!entries) {
+        admin_reply_text(fd, 500, "Internal Server Error", "out of memory\n");
+        return;
+    }
+    int count = cache_list(entries, max, sort);
+    
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if(!out) {
+        free(entries);
+        admin_reply_text(fd, 500, "Internal Server Error", "out of memory\n");
+        return;
+    }
+    
+    time_t now = time(NULL);
+    fprintf(out, "# hits\tbytes\tage\tttl\tmethod\turl\n");
+    for(int i = 0; i < count; i++) {
+        cache_entry_info *e = &entries[i];
+        fprintf(out, "%ld\t%ld\t%ld\t", e->hits, e->len, (long)(now - e->created));
+        if(e->expires) fprintf(out, "%ld\t", (long)(e->expires - now));
+        else fprintf(out, "-\t");
+        fprintf(out, "%s\t%s\n", e->method, e->url);
+    }
+    fclose(out);
+    
+    admin_reply(fd, 200, "OK", body, len);
+    free(body);
+    free(entries);
+}
+
+static void admin_purge(int fd, const char *query, const char *body) {
+    // Percent-decoding never grows a value, so the longer source bounds the key
+    size_t url_len = 1;
+    if(query && strlen(query) >= url_len) url_len = strlen(query) + 1;
+    if(body && strlen(body) >= url_len) url_len = strlen(body) + 1;
+    
+    char *url = (char*)malloc(url_len);
+    if(!url) {
+        admin_reply_text(fd, 500, "Internal Server Error", "out of memory\n");
+        return;
+    }
+    
+    int prefix = 0, found = 0;
+    const char *sources[2] = { query, body };
+    for(int i = 0; i < 2 && !found; i++) {
+        if(admin_param(sources[i], "key", url, url_len) == 0) {
+            found = 1;
+        } else if(admin_param(sources[i], "prefix", url, url_len) == 0) {
+            found = prefix = 1;
+        }
+    }
+    
+    if(!found || url[0] == '\0') {
+        admin_reply_text(fd, 400, "Bad Request", "key= or prefix= required\n");
+    } else {
+        char reply[64];
+        int purged = cache_purge(url, prefix);
+        printf("Admin purge %s%s: %d entries\n", url, prefix ? "*" : "", purged);
+        snprintf(reply, sizeof(reply), "purged %d\n", purged);
+        admin_reply_text(fd, 200, "OK", reply);
+    }
+    free(url);
+}
+
+static void *prefetch_worker(void *arg) {
+    prefetch_run *run = (prefetch_run*)arg;
+    
+    int i;
+    while((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->count) {
+        if(admin_fetch(run->urls[i], "GET") < 0) {
+            printf("Prefetch failed: %s\n", run->urls[i]);
+            __atomic_fetch_add(&run->failed, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&run->ok, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Fetch every URL in body (one per line, '#' comments) with at most
+// parallel fetches in flight; answers once all are done
+static void admin_prefetch(int fd, const char *query, char *body) {
+    char value[16];
+    int parallel = 4;
+    if(admin_param(query, "parallel", value, sizeof(value)) == 0) parallel = atoi(value);
+    if(parallel < 1) parallel = 1;
+    if(parallel > ADMIN_MAX_PARALLEL) parallel = ADMIN_MAX_PARALLEL;
+    
+    prefetch_run run;
+    memset(&run, 0, sizeof(run));
+    int capacity = 0;
+    
+    char *saveptr = NULL;
+    for(char *line = body ? strtok_r(body, "\r\n", &saveptr) : NULL; line;
+        line = strtok_r(NULL, "\r\n", &saveptr)) {
+        trim_whitespace(line);
+        if(line[0] == '\0' || line[0] == '#') continue;
+        
+        if(run.count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = (char**)realloc(run.urls, capacity * sizeof(char*));
+            if(!grown) break;
+            run.urls = grown;
+        }
+        run.urls[run.count++] = line;
+    }
+    
+    if(run.count == 0) {
+        free(run.urls);
+        admin_reply_text(fd, 400, "Bad Request", "no URLs in request body\n");
+        return;
+    }
+    
+    printf("Admin prefetch: %d URLs, %d in parallel\n", run.count, parallel);
+    if(parallel > run.count) parallel = run.count;
+    
+    pthread_t threads[ADMIN_MAX_PARALLEL];
+    int started = 0;
+    for(; started < parallel; started++) {
+        if(pthread_create(&threads[started], NULL, prefetch_worker, &run) != 0) break;
+    }
+    if(started == 0) prefetch_worker(&run);
+    for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    
+    char reply[128];
+    snprintf(reply, sizeof(reply), "requested %d\nfetched %d\nfailed %d\n",
+             run.count, run.ok, run.failed);
+    admin_reply_text(fd, 200, "OK", reply);
+    free(run.urls);
+}
+
+// Read a whole request, body included; returns its length or -1
+static int admin_read_request(int fd, char *buf, int cap) {
+    int len = 0;
+    char *headers_end = NULL;
+    
+    while(len < cap - 1) {
+        int n = recv(fd, buf + len, cap - 1 - len, 0);
+        if(n <= 0) return -1;
+        len += n;
+        buf[len] = '\0';
+        
+        if(!headers_end && (headers_end = strstr(buf, "\r\n\r\n")) == NULL) continue;
+        
+        char *cl = strcasestr(buf, "\r\nContent-Length:");
+        long body_len = cl && cl < headers_end ? atol(cl + 17) : 0;
+        if((headers_end + 4 - buf) + body_len <= len) return len;
+    }
+    return -1;
+}
+
+static void *admin_conn(void *arg) {
+    int fd = (int)(long)arg;
+    
+    struct timeval tv = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    
+    char *buf = (char*)malloc(ADMIN_MAX_REQUEST);
+    ParsedRequest *request = ParsedRequest_create();
+    
+    if(!buf || !request) {
+        admin_reply_text(fd, 500, "Internal Server Error", "out of memory\n");
+    } else if(admin_read_request(fd, buf, ADMIN_MAX_REQUEST) < 0 ||
+              ParsedRequest_parse(request, buf, strlen(buf)) < 0 || !request->path) {
+        admin_reply_text(fd, 400, "Bad Request", "malformed request\n");
+    } else {
+        char *query = strchr(request->path, '?');
+        if(query) *query++ = '\0';
+        int get = !strcmp(request->method, "GET");
+        int post = !strcmp(request->method, "POST");
+        
+        if(get && !strcmp(request->path, "/stats")) {
+            admin_stats(fd);
+        } else if(get && !strcmp(request->path, "/entries")) {
+            admin_entries(fd, query);
+        } else if(post && !strcmp(request->path, "/purge")) {
+            admin_purge(fd, query, request->body);
+        } else if(post && !strcmp(request->path, "/prefetch")) {
+            admin_prefetch(fd, query, request->body);
+        } else {
+            admin_reply_text(fd, 404, "Not Found",
+                             "GET /stats, GET /entries, POST /purge, POST /prefetch\n");
+        }
+    }
+    
+    ParsedRequest_destroy(request);
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+static void *admin_loop(void *arg) {
+    (void)arg;
+    
+    // The receive timeout on admin_socket wakes accept() to notice admin_stop()
+    while(!__atomic_load_n(&admin_stopping, __ATOMIC_ACQUIRE)) {
+        int fd = accept(admin_socket, NULL, NULL);
+        if(fd < 0) {
+            if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) perror("Admin accept failed");
+            continue;
+        }
+        
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, admin_conn, (void*)(long)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    
+    close(admin_socket);
+    return NULL;
+}
+
+int admin_init(int port, int fd, refresh_fetch_fn fetch) {
+    admin_fetch = fetch;
+    admin_socket = fd;
+    
+    if(admin_socket < 0) {
+        admin_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if(admin_socket < 0) {
+            perror("Failed to create admin socket");
+            return -1;
+        }
+        
+        int reuse = 1;
+        setsockopt(admin_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        
+        // Loopback only: the admin port can purge and fill the cache
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        
+        if(bind(admin_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(admin_socket, 16) < 0) {
+            perror("Admin port is not available");
+            close(admin_socket);
+            return -1;
+        }
+    }
+    
+    struct timeval tv = { 0, 500000 };
+    setsockopt(admin_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, admin_loop, NULL) != 0) {
+        close(admin_socket);
+        return -1;
+    }
+    pthread_detach(tid);
+    
+    // Report the bound address: an inherited listener may differ from admin_port
+    struct sockaddr_in bound;
+    socklen_t bound_len = sizeof(bound);
+    char ip[INET_ADDRSTRLEN] = "?";
+    if(getsockname(admin_socket, (struct sockaddr*)&bound, &bound_len) == 0) {
+        inet_ntop(AF_INET, &bound.sin_addr, ip, sizeof(ip));
+        port = ntohs(bound.sin_port);
+    }
+    printf("Admin API listening on %s:%d\n", ip, port);
+    return 0;
+}
+
+int admin_listener(void) {
+    return admin_socket;
+}
+
+void admin_stop(void) {
+    __atomic_store_n(&admin_stopping, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,27 @@
+#ifndef PROXY_ADMIN_H
+#define PROXY_ADMIN_H
+
+// Cache administration on a separate port bound to 127.0.0.1. Plain HTTP,
+// one request per connection:
+//
+//   GET  /stats                             summary counters
+//   GET  /entries?n=20&sort=hits|size|age   top cache entries
+//   POST /purge?key=URL  or  ?prefix=URL    drop matching entries
+//   POST /prefetch?parallel=4               body: URLs to fetch, one per line
+
+#include "proxy_refresh.h"
+
+#define ADMIN_MAX_REQUEST (1 << 20)     // prefetch lists included
+#define ADMIN_MAX_ENTRIES 1000
+#define ADMIN_MAX_PARALLEL 64
+
+// fetch fills the cache for one URL through the normal request path.
+// fd >= 0 serves on an already listening socket taken over from another
+// process instead of binding port.
+int admin_init(int port, int fd, refresh_fetch_fn fetch);
+int admin_listener(void);       // -1 if the admin API is off
+
+// Stop accepting admin requests (hot restart); requests in progress finish
+void admin_stop(void);
+
+#endif // PROXY_ADMIN_H
@@ -0,0 +1,158 @@
+#include "proxy_admission.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// Per-client state lives in an open-addressed table probed over a short
+// window. Slots are never emptied, only taken over once their client is
+// idle and its bucket full again, so forgetting it changes nothing.
+#define ADMISSION_SLOTS 4096
+#define ADMISSION_PROBE 16
+
+typedef struct admission_client {
+    uint32_t addr;                  // 0 = never used
+    int active;
+    double tokens;
+    uint64_t refilled_ns;           // tokens are current as of this time
+} admission_client;
+
+static admission_client clients[ADMISSION_SLOTS];
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Settings and counters below are protected by admission_lock
+static double client_rate;
+static double client_burst;
+static int client_max_active;
+static uint64_t queue_target_ns;
+static uint64_t queue_interval_ns;
+static uint64_t above_target_until;  // end of the grace interval, 0 = waits under target
+static uint64_t overloaded_until;   // overload holds at least an interval once entered
+static int overloaded;
+static admission_stats counters;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void admission_configure(int rate, int burst, int max_active, int target_ms, int interval_ms) {
+    pthread_mutex_lock(&admission_lock);
+    client_rate = rate > 0 ? rate : 0;
+    client_burst = burst > 1 ? burst : 1;
+    client_max_active = max_active > 0 ? max_active : 0;
+    queue_target_ns = target_ms > 0 ? (uint64_t)target_ms * 1000000 : 0;
+    queue_interval_ns = interval_ms > 0 ? (uint64_t)interval_ms * 1000000 : 0;
+    if(!queue_target_ns) {
+        overloaded = 0;
+        above_target_until = 0;
+    }
+    pthread_mutex_unlock(&admission_lock);
+}
+
+static void refill(admission_client *c, uint64_t now) {
+    if(client_rate > 0 && now > c->refilled_ns) {
+        c->tokens += (now - c->refilled_ns) / 1e9 * client_rate;
+        if(c->tokens > client_burst) c->tokens = client_burst;
+    }
+    c->refilled_ns = now;
+}
+
+// Find addr's slot, claiming a free one if it has none; NULL if the whole
+// probe window belongs to other busy clients. Caller holds admission_lock.
+static admission_client *client_slot(uint32_t addr, uint64_t now, int claim) {
+    uint32_t h = addr * 2654435761u;
+    admission_client *free_slot = NULL;
+    
+    for(int i = 0; i < ADMISSION_PROBE; i++) {
+        admission_client *c = &clients[(h + i) % ADMISSION_SLOTS];
+        if(c->addr == addr && addr != 0) return c;
+        if(!claim || free_slot || c->active > 0) continue;
+        if(c->addr != 0) refill(c, now);
+        if(c->addr == 0 || client_rate == 0 || c->tokens >= client_burst) free_slot = c;
+    }
+    if(free_slot) {
+        free_slot->addr = addr;
+        free_slot->active = 0;
+        free_slot->tokens = client_burst;
+        free_slot->refilled_ns = now;
+    }
+    return free_slot;
+}
+
+int admission_check(uint32_t addr, int busy, int *retry_after, int *tracked) {
+    uint64_t now = now_ns();
+    int status = 0;
+    *retry_after = 0;
+    *tracked = 0;
+    
+    pthread_mutex_lock(&admission_lock);
+    if(busy && overloaded) {
+        counters.shed_accept++;
+        *retry_after = 1;
+        status = 503;
+    } else if(client_rate > 0 || client_max_active > 0) {
+        // A client that finds no slot (or has no address) is admitted untracked
+        admission_client *c = addr ? client_slot(addr, now, 1) : NULL;
+        if(c) refill(c, now);
+        
+        if(c && client_max_active > 0 && c->active >= client_max_active) {
+            counters.limited_active++;
+            *retry_after = 1;
+            status = 429;
+        } else if(c && client_rate > 0 && c->tokens < 1) {
+            counters.limited_rate++;
+            *retry_after = (int)((1 - c->tokens) / client_rate) + 1;
+            status = 429;
+        } else if(c) {
+            if(client_rate > 0) c->tokens -= 1;
+            c->active++;
+            *tracked = 1;
+        }
+    }
+    if(status == 0) counters.admitted++;
+    pthread_mutex_unlock(&admission_lock);
+    return status;
+}
+
+void admission_release(uint32_t addr) {
+    pthread_mutex_lock(&admission_lock);
+    admission_client *c = client_slot(addr, 0, 0);
+    if(c && c->active > 0) c->active--;
+    pthread_mutex_unlock(&admission_lock);
+}
+
+int admission_dequeue(uint64_t wait_ns) {
+    uint64_t now = now_ns();
+    int shed = 0;
+    
+    pthread_mutex_lock(&admission_lock);
+    if(!queue_target_ns || wait_ns < queue_target_ns) {
+        above_target_until = 0;
+        if(overloaded && (!queue_target_ns || now >= overloaded_until)) {
+            printf("Queue delay back under target, admitting again\n");
+            overloaded = 0;
+        }
+    } else if(!above_target_until) {
+        above_target_until = now + queue_interval_ns;
+    } else if(now >= above_target_until && !overloaded) {
+        printf("Queue delay above target for %llu ms, shedding load\n",
+               (unsigned long long)(queue_interval_ns / 1000000));
+        overloaded = 1;
+        overloaded_until = now + queue_interval_ns;
+    }
+    if(overloaded && wait_ns >= queue_target_ns) {
+        counters.shed_queue++;
+        shed = 1;
+    }
+    pthread_mutex_unlock(&admission_lock);
+    return shed;
+}
+
+void admission_get_stats(admission_stats *stats) {
+    pthread_mutex_lock(&admission_lock);
+    *stats = counters;
+    stats->overloaded = overloaded;
+    pthread_mutex_unlock(&admission_lock);
+}
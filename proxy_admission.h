@@ -0,0 +1,47 @@
+#ifndef PROXY_ADMISSION_H
+#define PROXY_ADMISSION_H
+
+// Admission control at accept time, so overload is refused quickly instead
+// of queueing without bound. Two limits apply:
+//
+// Per client IP, a token bucket (client_rate requests/s, client_burst deep)
+// and a cap on concurrent requests (client_max_active). Either answers 429
+// with Retry-After, so one aggressive client cannot take every worker slot.
+//
+// Globally, a CoDel-style queue-delay target on the wait for a worker slot.
+// A wait above queue_target_ms is only bursty, but waits that stay above it
+// for queue_interval_ms are a standing queue. Then the proxy is overloaded:
+// a request that waited past the target is shed when it reaches its slot,
+// and new connections are refused while every slot is busy, both with 503.
+// The first wait back under the target after at least another interval
+// ends the overload.
+
+#include <stdint.h>
+
+typedef struct admission_stats {
+    long long admitted;
+    long long limited_rate;         // 429: client over its token bucket
+    long long limited_active;       // 429: client at its concurrency cap
+    long long shed_accept;          // 503: refused at accept while overloaded
+    long long shed_queue;           // 503: waited past the target while overloaded
+    int overloaded;
+} admission_stats;
+
+// Reloadable; 0 turns the respective limit off
+void admission_configure(int rate, int burst, int max_active, int target_ms, int interval_ms);
+
+// Decide on a new connection from addr (IPv4, network order). busy means
+// every worker slot is taken. Returns 0 to admit, or the status to refuse
+// with and the Retry-After seconds. An admitted request sets *tracked if it
+// is counted against addr; only those may be given back with
+// admission_release(), once each.
+int admission_check(uint32_t addr, int busy, int *retry_after, int *tracked);
+void admission_release(uint32_t addr);
+
+// An admitted request got its worker slot after waiting wait_ns; returns 1
+// if it should be shed instead of served
+int admission_dequeue(uint64_t wait_ns);
+
+void admission_get_stats(admission_stats *stats);
+
+#endif // PROXY_ADMISSION_H
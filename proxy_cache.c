@@ -0,0 +1,437 @@
+#include "proxy_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+cache_element *head;
+long cache_size;
+long cache_max_size = MAX_SIZE;
+long cache_max_element_size = MAX_ELEMENT_SIZE;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters below are protected by lock
+static long cache_entries;
+static long long cache_hits, cache_misses, cache_inserts, cache_evictions, cache_purged;
+
+typedef struct origin_failure {
+    char origin[ORIGIN_KEY_LEN];    // "host:port"
+    int code;
+    time_t until;
+} origin_failure;
+
+static origin_failure origin_failures[ORIGIN_FAILURE_SLOTS];
+static pthread_mutex_t origin_failure_lock = PTHREAD_MUTEX_INITIALIZER;
+
+cache_element* find(char* url, char* method){
+    cache_element* site = NULL;
+    
+    int temp_lock_val = pthread_mutex_lock(&lock);
+    if(temp_lock_val != 0) {
+        printf("Cache lock failed: %d\n", temp_lock_val);
+        return NULL;
+    }
+    
+    if(head != NULL) {
+        site = head;
+        while(site != NULL) {
+            if(!strcmp(site->url, url) && !strcmp(site->method, method)) {
+                printf("URL found in cache for method %s\n", method);
+                site->lru_time_track = time(NULL);
+                site->refs++;
+                site->hits++;
+                break;
+            }
+            site = site->next;
+        }
+    }
+    if(site) cache_hits++;
+    else cache_misses++;
+    
+    pthread_mutex_unlock(&lock);
+    return site;
+}
+
+static void free_cache_element(cache_element *element){
+    cache_chunks_free(element->chunks);
+    free(element->url);
+    free(element->method);
+    free(element);
+}
+
+void cache_element_release(cache_element *element){
+    if(element == NULL) return;
+    
+    pthread_mutex_lock(&lock);
+    element->refs--;
+    int last = element->refs == 0 && element->evicted;
+    pthread_mutex_unlock(&lock);
+    
+    if(last) free_cache_element(element);
+}
+
+// Unlink element (whose predecessor is prev, NULL for head) and drop its
+// accounting; caller must hold the cache lock
+static void unlink_cache_element_locked(cache_element *prev, cache_element *temp){
+    if(prev == NULL) {
+        head = temp->next;
+    } else {
+        prev->next = temp->next;
+    }
+    
+    // Mirror the accounting in add_cache_element() exactly
+    cache_size = cache_size - (temp->len + 1) - sizeof(cache_element) - 
+                 strlen(temp->url) - strlen(temp->method) - 2;
+    cache_entries--;
+    
+    // A reader still sending this element frees it on release
+    if(temp->refs > 0) {
+        temp->evicted = 1;
+    } else {
+        free_cache_element(temp);
+    }
+}
+
+// Evict the least recently used element; caller must hold the cache lock
+static void remove_cache_element_locked(){
+    if(head != NULL) {
+        cache_element *p = NULL;
+        cache_element *q = head; 
+        cache_element *temp = head;
+        
+        // Find element with oldest LRU timestamp
+        for(q = head; q->next != NULL; q = q->next) {
+            if((q->next)->lru_time_track < temp->lru_time_track) {
+                temp = q->next;
+                p = q;
+            }
+        }
+        
+        unlink_cache_element_locked(p, temp);
+        cache_evictions++;
+        printf("Cache element removed\n");
+    }
+}
+
+void remove_cache_element(){
+    int temp_lock_val = pthread_mutex_lock(&lock);
+    if(temp_lock_val != 0) {
+        printf("Remove cache lock failed: %d\n", temp_lock_val);
+        return;
+    }
+    
+    remove_cache_element_locked();
+    
+    pthread_mutex_unlock(&lock);
+}
+
+int add_cache_element(char* data, int size, char* url, char* method){
+    return add_cache_element_expiring(data, size, url, method, 0, 0, 0);
+}
+
+int add_cache_element_expiring(char* data, int size, char* url, char* method,
+                               time_t expires, int stale_while_revalidate, int stale_if_error){
+    if(size < 0 || size > __atomic_load_n(&cache_max_element_size, __ATOMIC_RELAXED)) {
+        printf("Element too large for cache\n");
+        return 0;
+    }
+    
+    // Copy into chunks, the last one sized to fit
+    cache_chunk *chunks = NULL, **tail = &chunks;
+    for(int off = 0; off < size || chunks == NULL; ) {
+        int len = size - off < CACHE_CHUNK_SIZE ? size - off : CACHE_CHUNK_SIZE;
+        cache_chunk *chunk = (cache_chunk*)malloc(sizeof(cache_chunk) + len);
+        if(!chunk) {
+            cache_chunks_free(chunks);
+            return 0;
+        }
+        memcpy(chunk->data, data + off, len);
+        chunk->len = len;
+        chunk->next = NULL;
+        *tail = chunk;
+        tail = &chunk->next;
+        off += len;
+    }
+    
+    cache_element *element = add_cache_element_chunks(chunks, size, url, method, expires,
+                                                      stale_while_revalidate, stale_if_error);
+    if(!element) {
+        cache_chunks_free(chunks);
+        return 0;
+    }
+    cache_element_release(element);
+    return 1;
+}
+
+cache_chunk *cache_chunk_alloc(void){
+    cache_chunk *chunk = (cache_chunk*)malloc(sizeof(cache_chunk) + CACHE_CHUNK_SIZE);
+    if(chunk) {
+        chunk->next = NULL;
+        chunk->len = 0;
+    }
+    return chunk;
+}
+
+void cache_chunks_free(cache_chunk *chunks){
+    while(chunks) {
+        cache_chunk *next = chunks->next;
+        free(chunks);
+        chunks = next;
+    }
+}
+
+cache_element *add_cache_element_chunks(cache_chunk *chunks, int size, char *url, char *method,
+                                        time_t expires, int stale_while_revalidate, int stale_if_error){
+    int temp_lock_val = pthread_mutex_lock(&lock);
+    if(temp_lock_val != 0) {
+        printf("Add cache lock failed: %d\n", temp_lock_val);
+        return NULL;
+    }
+    
+    long element_size = size + 1 + strlen(url) + strlen(method) + 2 + sizeof(cache_element);
+    
+    if(element_size > cache_max_element_size) {
+        printf("Element too large for cache\n");
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    
+    // A refresh replaces the copy it revalidated rather than shadowing it
+    cache_element *prev = NULL;
+    for(cache_element *e = head; e != NULL; prev = e, e = e->next) {
+        if(!strcmp(e->url, url) && !strcmp(e->method, method)) {
+            unlink_cache_element_locked(prev, e);
+            break;
+        }
+    }
+    
+    // Make space if needed (we already hold the lock). After the budget
+    // shrinks the cache can be far over it; evict at most a batch here and
+    // leave the rest to cache_trim() rather than stalling every reader.
+    int evicted = 0;
+    while(head != NULL && cache_size + element_size > cache_max_size && evicted < CACHE_EVICT_BATCH) {
+        remove_cache_element_locked();
+        evicted++;
+    }
+    if(cache_size + element_size > cache_max_size) {
+        printf("Cache over budget, not caching %s %s\n", method, url);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    
+    cache_element* element = (cache_element*)malloc(sizeof(cache_element));
+    if(!element) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    
+    element->url = (char*)malloc(strlen(url) + 1);
+    element->method = (char*)malloc(strlen(method) + 1);
+    
+    if(!element->url || !element->method) {
+        if(element->url) free(element->url);
+        if(element->method) free(element->method);
+        free(element);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    
+    element->chunks = chunks;
+    strcpy(element->url, url);
+    strcpy(element->method, method);
+    element->lru_time_track = time(NULL);
+    element->created = element->lru_time_track;
+    element->hits = 0;
+    element->refs = 1;
+    element->evicted = 0;
+    element->expires = expires;
+    element->stale_while_revalidate = stale_while_revalidate;
+    element->stale_if_error = stale_if_error;
+    element->len = size;
+    element->next = head;
+    
+    head = element;
+    cache_size += element_size;
+    cache_entries++;
+    cache_inserts++;
+    
+    printf("Added to cache: %s %s (%d bytes)\n", method, url, size);
+    
+    pthread_mutex_unlock(&lock);
+    return element;
+}
+
+void cache_set_limits(long max_size, long max_element_size){
+    pthread_mutex_lock(&lock);
+    cache_max_size = max_size;
+    cache_max_element_size = max_element_size;
+    pthread_mutex_unlock(&lock);
+}
+
+// Evict up to batch elements while over budget; returns 1 if still over
+int cache_trim(int batch){
+    pthread_mutex_lock(&lock);
+    while(head != NULL && cache_size > cache_max_size && batch-- > 0) {
+        remove_cache_element_locked();
+    }
+    int over = head != NULL && cache_size > cache_max_size;
+    pthread_mutex_unlock(&lock);
+    return over;
+}
+
+int cache_element_state(cache_element *element, time_t now){
+    if(element->expires == 0 || now < element->expires) return CACHE_FRESH;
+    if(now < element->expires + element->stale_while_revalidate) return CACHE_STALE;
+    return CACHE_EXPIRED;
+}
+
+int cache_element_usable_on_error(cache_element *element, time_t now){
+    return element->expires == 0 || now < element->expires + element->stale_if_error;
+}
+
+static origin_failure *origin_failure_slot(const char *origin){
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for(const char *c = origin; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return &origin_failures[hash % ORIGIN_FAILURE_SLOTS];
+}
+
+void origin_failure_record(const char *host, int port, int code, int ttl){
+    if(ttl <= 0) return;
+    
+    char origin[ORIGIN_KEY_LEN];
+    snprintf(origin, sizeof(origin), "%s:%d", host, port);
+    
+    pthread_mutex_lock(&origin_failure_lock);
+    origin_failure *slot = origin_failure_slot(origin);
+    strcpy(slot->origin, origin);
+    slot->code = code;
+    slot->until = time(NULL) + ttl;
+    pthread_mutex_unlock(&origin_failure_lock);
+}
+
+int origin_failure_lookup(const char *host, int port){
+    char origin[ORIGIN_KEY_LEN];
+    snprintf(origin, sizeof(origin), "%s:%d", host, port);
+    
+    pthread_mutex_lock(&origin_failure_lock);
+    origin_failure *slot = origin_failure_slot(origin);
+    int code = 0;
+    if(slot->until > time(NULL) && !strcmp(slot->origin, origin)) {
+        code = slot->code;
+    }
+    pthread_mutex_unlock(&origin_failure_lock);
+    return code;
+}
+
+int cache_purge(const char *url, int prefix){
+    size_t url_len = strlen(url);
+    int purged = 0;
+    
+    pthread_mutex_lock(&lock);
+    cache_element *prev = NULL, *e = head;
+    while(e != NULL) {
+        cache_element *next = e->next;
+        int match = prefix ? !strncmp(e->url, url, url_len) : !strcmp(e->url, url);
+        if(match) {
+            unlink_cache_element_locked(prev, e);
+            purged++;
+        } else {
+            prev = e;
+        }
+        e = next;
+    }
+    cache_purged += purged;
+    pthread_mutex_unlock(&lock);
+    
+    return purged;
+}
+
+void cache_get_stats(cache_stats *stats){
+    pthread_mutex_lock(&lock);
+    stats->entries = cache_entries;
+    stats->bytes = cache_size;
+    stats->max_bytes = cache_max_size;
+    stats->hits = cache_hits;
+    stats->misses = cache_misses;
+    stats->inserts = cache_inserts;
+    stats->evictions = cache_evictions;
+    stats->purged = cache_purged;
+    pthread_mutex_unlock(&lock);
+}
+
+// Does a rank ahead of b in the given sort order?
+static int cache_ranks_before(cache_element *a, cache_entry_info *b, int sort){
+    switch(sort) {
+        case CACHE_SORT_SIZE: return a->len > b->len;
+        case CACHE_SORT_AGE: return a->created < b->created;
+        default: return a->hits > b->hits;
+    }
+}
+
+// Fill out with up to max entries, best first; returns how many
+int cache_list(cache_entry_info *out, int max, int sort){
+    int count = 0;
+    
+    pthread_mutex_lock(&lock);
+    for(cache_element *e = head; e != NULL; e = e->next) {
+        // Insertion into the sorted top-max array
+        int pos = count;
+        while(pos > 0 && cache_ranks_before(e, &out[pos - 1], sort)) pos--;
+        if(pos >= max) continue;
+        
+        int last = count < max ? count : max - 1;
+        memmove(&out[pos + 1], &out[pos], (last - pos) * sizeof(cache_entry_info));
+        if(count < max) count++;
+        
+        cache_entry_info *info = &out[pos];
+        snprintf(info->url, sizeof(info->url), "%s", e->url);
+        snprintf(info->method, sizeof(info->method), "%s", e->method);
+        info->len = e->len;
+        info->hits = e->hits;
+        info->created = e->created;
+        info->expires = e->expires;
+    }
+    pthread_mutex_unlock(&lock);
+    
+    return count;
+}
+
+static int cache_hits_desc(const void *a, const void *b){
+    long x = (*(cache_element* const*)a)->hits, y = (*(cache_element* const*)b)->hits;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Most-hit entries still worth serving, pinned so they can be streamed out
+// after the lock is dropped; entries that would overrun max_bytes are skipped
+cache_element **cache_pin_hottest(long max_bytes, int *count){
+    *count = 0;
+    time_t now = time(NULL);
+    
+    pthread_mutex_lock(&lock);
+    cache_element **all = (cache_element**)malloc((cache_entries + 1) * sizeof(cache_element*));
+    if(!all) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    
+    int n = 0;
+    for(cache_element *e = head; e != NULL; e = e->next) {
+        if(cache_element_state(e, now) != CACHE_EXPIRED || cache_element_usable_on_error(e, now)) {
+            all[n++] = e;
+        }
+    }
+    qsort(all, n, sizeof(cache_element*), cache_hits_desc);
+    
+    long bytes = 0;
+    for(int i = 0; i < n; i++) {
+        if(bytes + all[i]->len > max_bytes) continue;
+        bytes += all[i]->len;
+        all[i]->refs++;
+        all[(*count)++] = all[i];
+    }
+    pthread_mutex_unlock(&lock);
+    
+    return all;
+}
@@ -0,0 +1,123 @@
+#ifndef PROXY_CACHE_H
+#define PROXY_CACHE_H
+
+// LRU response cache shared by all proxy worker threads
+
+#include <time.h>
+#include <pthread.h>
+
+#define MAX_SIZE 200*(1<<20)
+#define MAX_ELEMENT_SIZE 10*(1<<20)
+#define CACHE_EVICT_BATCH 64        // most elements evicted under one lock hold
+#define CACHE_CHUNK_SIZE (64*1024)  // responses are stored and filled in chunks of this size
+
+// One piece of a stored response. Chunks are full except the last, which
+// is trimmed to its length when the response is inserted.
+typedef struct cache_chunk cache_chunk;
+struct cache_chunk
+{
+    cache_chunk *next;
+    int len;
+    char data[];
+};
+
+typedef struct cache_element cache_element;
+struct cache_element
+{
+    cache_chunk *chunks;            // the response, len bytes in all
+    int len;
+    char *url;
+    char *method;
+    time_t lru_time_track;
+    time_t created;
+    long hits;
+    int refs;                       // readers holding this element via find()
+    int evicted;                    // unlinked; freed when the last reader releases it
+    time_t expires;                 // end of freshness; 0 never expires
+    int stale_while_revalidate;     // seconds past expires still served while refreshing
+    int stale_if_error;             // seconds past expires still served if the origin fails
+    cache_element *next;
+};
+
+extern cache_element *head;
+extern long cache_size;
+extern long cache_max_size;
+extern long cache_max_element_size;
+extern pthread_mutex_t lock;
+
+typedef struct cache_stats {
+    long entries;
+    long bytes;                     // accounted size, including per-entry overhead
+    long max_bytes;
+    long long hits;                 // find() calls that returned an entry
+    long long misses;
+    long long inserts;
+    long long evictions;            // LRU evictions; replacements and purges not counted
+    long long purged;
+} cache_stats;
+
+// Snapshot of one entry for the admin listing
+#define CACHE_INFO_URL_LEN 512
+enum { CACHE_SORT_HITS, CACHE_SORT_SIZE, CACHE_SORT_AGE };
+
+typedef struct cache_entry_info {
+    char url[CACHE_INFO_URL_LEN];   // truncated if longer
+    char method[16];
+    long len;
+    long hits;
+    time_t created;
+    time_t expires;
+} cache_entry_info;
+
+// find() pins the element it returns; callers must cache_element_release()
+// it once done so eviction cannot free data still being sent
+cache_element *find(char *url, char *method);
+void cache_element_release(cache_element *element);
+int add_cache_element(char *data, int size, char *url, char *method);
+void remove_cache_element();
+
+// Adds with a freshness lifetime, replacing any entry under the same key
+int add_cache_element_expiring(char *data, int size, char *url, char *method,
+                               time_t expires, int stale_while_revalidate, int stale_if_error);
+
+// Streaming fill: a response relayed straight into chunks from
+// cache_chunk_alloc() is inserted without copying. On success the cache
+// owns the chunks and the element comes back pinned, as from find(); on
+// failure (NULL) they still belong to the caller.
+cache_chunk *cache_chunk_alloc(void);
+void cache_chunks_free(cache_chunk *chunks);
+cache_element *add_cache_element_chunks(cache_chunk *chunks, int size, char *url, char *method,
+                                        time_t expires, int stale_while_revalidate, int stale_if_error);
+
+// Freshness of a (pinned) element at time now
+enum { CACHE_FRESH, CACHE_STALE, CACHE_EXPIRED };
+int cache_element_state(cache_element *element, time_t now);
+int cache_element_usable_on_error(cache_element *element, time_t now);
+
+// Change the budget; shrinking leaves the cache over budget until
+// cache_trim() catches up, a batch at a time
+void cache_set_limits(long max_size, long max_element_size);
+int cache_trim(int batch);
+
+// Admin operations: purge every method cached under url (or every url
+// starting with it), summary counters, and the top entries by sort order
+int cache_purge(const char *url, int prefix);
+void cache_get_stats(cache_stats *stats);
+int cache_list(cache_entry_info *out, int max, int sort);
+
+// Pin the most-hit entries still worth serving, up to max_bytes of
+// responses in all, for handing the cache to a new process. Returns a
+// malloc'd array of *count pinned elements, hottest first; release each
+// and free the array.
+cache_element **cache_pin_hottest(long max_bytes, int *count);
+
+// Negative cache of origins that recently failed to resolve or connect,
+// keyed by host and port. A fixed direct-mapped table: a colliding origin
+// simply overwrites the slot, which at worst costs one extra connect attempt.
+#define ORIGIN_FAILURE_SLOTS 256
+#define ORIGIN_KEY_LEN 272
+
+void origin_failure_record(const char *host, int port, int code, int ttl);
+int origin_failure_lookup(const char *host, int port);     // recorded code, or 0
+
+#endif // PROXY_CACHE_H
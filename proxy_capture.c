@@ -0,0 +1,122 @@
+#include "proxy_capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_fp;
+static char capture_path[1024];
+static uint64_t capture_salt;
+static uint64_t capture_base_ns;    // t_us = 0 in the file
+
+static uint64_t fnv1a(uint64_t hash, const char *s, size_t len) {
+    for(size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char)s[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// Salted, non-reversible token for a hash
+static uint64_t anon_mix(uint64_t value) {
+    uint64_t x = value ^ capture_salt;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// http://h<host token>/<url token>[.ext]: the host token groups URLs by
+// origin, the URL token (from the full key) keeps every key distinct, and
+// a short extension is kept as a hint of the content type
+static void anonymize_url(const trace_record *trace, char *out, size_t out_len) {
+    const char *url = trace->url;
+    const char *host = strncmp(url, "http://", 7) == 0 ? url + 7 : url;
+    size_t host_len = strcspn(host, "/");
+    const char *path = host + host_len;
+    
+    char ext[12] = "";
+    size_t path_len = strcspn(path, "?");
+    const char *slash = path;
+    for(const char *c = path; c < path + path_len; c++) if(*c == '/') slash = c;
+    const char *dot = memchr(slash, '.', path + path_len - slash);
+    if(dot) {
+        size_t ext_len = path + path_len - dot - 1;
+        int ok = ext_len > 0 && ext_len < 8;
+        for(size_t i = 0; ok && i < ext_len; i++) ok = isalnum((unsigned char)dot[1 + i]);
+        if(ok) snprintf(ext, sizeof(ext), ".%.*s", (int)ext_len, dot + 1);
+    }
+    
+    uint64_t host_hash = fnv1a(14695981039346656037ULL, host, host_len);
+    snprintf(out, out_len, "http://h%08x/%016llx%s", (unsigned int)anon_mix(host_hash),
+             (unsigned long long)anon_mix(trace->url_hash), ext);
+}
+
+// Method and version come from the client as sent, so they are escaped
+// like any other string before going into the JSON
+static void json_escape(const char *in, char *out, size_t out_len) {
+    size_t n = 0;
+    for(; *in && n + 7 < out_len; in++) {
+        unsigned char c = (unsigned char)*in;
+        if(c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if(c < 0x20 || c >= 0x7f) {
+            n += snprintf(out + n, out_len - n, "\\u%04x", c);
+        } else {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+}
+
+int capture_configure(const char *path, const char *salt) {
+    pthread_mutex_lock(&capture_lock);
+    if(strcmp(path, capture_path) != 0) {
+        FILE *next = NULL;
+        if(path[0] && (next = fopen(path, "a")) == NULL) {
+            perror(path);
+            pthread_mutex_unlock(&capture_lock);
+            return -1;
+        }
+        if(capture_fp) fclose(capture_fp);
+        capture_fp = next;
+        snprintf(capture_path, sizeof(capture_path), "%s", path);
+        capture_base_ns = trace_now_ns();
+        
+        if(salt[0]) {
+            capture_salt = fnv1a(14695981039346656037ULL, salt, strlen(salt));
+        } else if(getrandom(&capture_salt, sizeof(capture_salt), 0) != sizeof(capture_salt)) {
+            capture_salt = capture_base_ns;
+        }
+        if(capture_fp) printf("Capturing traffic to %s\n", path);
+    }
+    pthread_mutex_unlock(&capture_lock);
+    return 0;
+}
+
+void capture_write(const trace_record *trace) {
+    // Tunnels carry no request to replay
+    if(!capture_fp || trace->outcome == TRACE_TUNNEL || !trace->method[0]) return;
+    
+    char key[64], method[6 * sizeof(trace->method) + 1], version[6 * sizeof(trace->version) + 1];
+    json_escape(trace->method, method, sizeof(method));
+    json_escape(trace->version[0] ? trace->version : "HTTP/1.1", version, sizeof(version));
+    
+    pthread_mutex_lock(&capture_lock);
+    if(capture_fp) {
+        anonymize_url(trace, key, sizeof(key));
+        long long t_us = ((long long)trace->start_ns - (long long)capture_base_ns) / 1000;
+        fprintf(capture_fp,
+                "{\"t_us\":%lld,\"method\":\"%s\",\"line\":\"%s %s %s\",\"key\":\"%s\","
+                "\"status\":%d,\"bytes\":%llu,\"outcome\":\"%s\",\"dur_us\":%u}\n",
+                t_us > 0 ? t_us : 0, method, method, key, version, key, trace->status,
+                (unsigned long long)trace->bytes,
+                trace->outcome < TRACE_OUTCOMES ? trace_outcome_names[trace->outcome] : "?",
+                trace->mark_us[TRACE_DONE]);
+        fflush(capture_fp);
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,17 @@
+#ifndef PROXY_CAPTURE_H
+#define PROXY_CAPTURE_H
+
+// Traffic capture for offline replay (tools/replay). Each finished request
+// is appended to capture_file as one JSON line: start offset, method,
+// request line, cache key, status, response bytes, outcome and duration.
+// Hosts and URLs are replaced by salted hashes, so the file can leave the
+// machine; the same URL always maps to the same anonymized key within a
+// capture, which keeps cache hit patterns intact on replay.
+
+#include "proxy_trace.h"
+
+// Reloadable; empty path = off. An empty salt picks a random one.
+int capture_configure(const char *path, const char *salt);
+void capture_write(const trace_record *trace);
+
+#endif // PROXY_CAPTURE_H
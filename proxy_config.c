@@ -0,0 +1,198 @@
+#include "proxy_config.h"
+#include "proxy_parse.h"
+#include "proxy_cache.h"
+#include "proxy_tunnel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+proxy_config config;
+
+static const struct {
+    const char *name;
+    int bit;
+} method_bits[] = {
+    { "GET", METHOD_GET },
+    { "HEAD", METHOD_HEAD },
+    { "POST", METHOD_POST },
+    { "PUT", METHOD_PUT },
+    { "PATCH", METHOD_PATCH },
+    { "DELETE", METHOD_DELETE },
+    { "OPTIONS", METHOD_OPTIONS },
+};
+
+void config_defaults(proxy_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->port_number = 8080;
+    cfg->cache_max_bytes = MAX_SIZE;
+    cfg->cache_max_element_bytes = MAX_ELEMENT_SIZE;
+    cfg->max_clients = MAX_CLIENTS;
+    cfg->max_tunnels = MAX_TUNNELS;
+    cfg->buffer_size = MAX_BYTES;
+    cfg->response_window = 256*1024;
+    cfg->connect_timeout_ms = 10000;
+    cfg->read_timeout_ms = 30000;
+    cfg->write_timeout_ms = 30000;
+    cfg->tunnel_idle_timeout = TUNNEL_IDLE_TIMEOUT;
+    cfg->cacheable_methods = METHOD_GET;
+    cfg->default_ttl = 300;
+    cfg->stale_while_revalidate = 60;
+    cfg->stale_if_error = 600;
+    cfg->refresh_workers = 4;
+    cfg->connect_failure_ttl = 5;
+    cfg->error_ttl_404 = 30;
+    cfg->error_ttl_5xx = 2;
+    cfg->slow_request_ms = 1000;
+    cfg->trace_sample = 100;
+    cfg->client_burst = 20;
+    cfg->queue_target_ms = 100;
+    cfg->queue_interval_ms = 1000;
+    cfg->drain_timeout = 30;
+}
+
+int config_method_bit(const char *method) {
+    for(size_t i = 0; i < sizeof(method_bits) / sizeof(method_bits[0]); i++) {
+        if(strcasecmp(method, method_bits[i].name) == 0) return method_bits[i].bit;
+    }
+    return 0;
+}
+
+// Sizes accept an optional k/m/g suffix
+static int parse_size(const char *value, long *out) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    if(end == value || n < 0) return -1;
+    
+    switch(tolower((unsigned char)*end)) {
+        case 'k': n *= 1L << 10; end++; break;
+        case 'm': n *= 1L << 20; end++; break;
+        case 'g': n *= 1L << 30; end++; break;
+    }
+    if(*end != '\0') return -1;
+    *out = n;
+    return 0;
+}
+
+static int parse_int(const char *value, int *out) {
+    long n;
+    if(parse_size(value, &n) < 0 || n > 0x7fffffff) return -1;
+    *out = (int)n;
+    return 0;
+}
+
+static int parse_string(const char *value, char *out, size_t out_len) {
+    if(strlen(value) >= out_len) return -1;
+    strcpy(out, value);
+    return 0;
+}
+
+static int parse_methods(char *value, int *out) {
+    int bits = 0;
+    char *saveptr = NULL;
+    for(char *tok = strtok_r(value, ", \t", &saveptr); tok; tok = strtok_r(NULL, ", \t", &saveptr)) {
+        int bit = config_method_bit(tok);
+        if(!bit) return -1;
+        bits |= bit;
+    }
+    *out = bits;
+    return 0;
+}
+
+static int apply_key(proxy_config *cfg, const char *key, char *value) {
+    if(strcmp(key, "port") == 0) return parse_int(value, &cfg->port_number);
+    if(strcmp(key, "reuseport") == 0) return parse_int(value, &cfg->reuseport_mode);
+    if(strcmp(key, "defer_accept_secs") == 0) return parse_int(value, &cfg->defer_accept_secs);
+    if(strcmp(key, "io_uring") == 0) return parse_int(value, &cfg->uring_mode);
+    if(strcmp(key, "refresh_workers") == 0) return parse_int(value, &cfg->refresh_workers);
+    if(strcmp(key, "admin_port") == 0) return parse_int(value, &cfg->admin_port);
+    if(strcmp(key, "upgrade_socket") == 0) return parse_string(value, cfg->upgrade_socket, sizeof(cfg->upgrade_socket));
+    if(strcmp(key, "upgrade_cache_bytes") == 0) return parse_size(value, &cfg->upgrade_cache_bytes);
+    if(strcmp(key, "cache_max_bytes") == 0) return parse_size(value, &cfg->cache_max_bytes);
+    if(strcmp(key, "cache_max_element_bytes") == 0) return parse_size(value, &cfg->cache_max_element_bytes);
+    if(strcmp(key, "max_clients") == 0) return parse_int(value, &cfg->max_clients);
+    if(strcmp(key, "max_tunnels") == 0) return parse_int(value, &cfg->max_tunnels);
+    if(strcmp(key, "buffer_size") == 0) return parse_int(value, &cfg->buffer_size);
+    if(strcmp(key, "response_window") == 0) return parse_int(value, &cfg->response_window);
+    if(strcmp(key, "connect_timeout_ms") == 0) return parse_int(value, &cfg->connect_timeout_ms);
+    if(strcmp(key, "read_timeout_ms") == 0) return parse_int(value, &cfg->read_timeout_ms);
+    if(strcmp(key, "write_timeout_ms") == 0) return parse_int(value, &cfg->write_timeout_ms);
+    if(strcmp(key, "tunnel_idle_timeout") == 0) return parse_int(value, &cfg->tunnel_idle_timeout);
+    if(strcmp(key, "cacheable_methods") == 0) return parse_methods(value, &cfg->cacheable_methods);
+    if(strcmp(key, "default_ttl") == 0) return parse_int(value, &cfg->default_ttl);
+    if(strcmp(key, "stale_while_revalidate") == 0) return parse_int(value, &cfg->stale_while_revalidate);
+    if(strcmp(key, "stale_if_error") == 0) return parse_int(value, &cfg->stale_if_error);
+    if(strcmp(key, "connect_failure_ttl") == 0) return parse_int(value, &cfg->connect_failure_ttl);
+    if(strcmp(key, "error_ttl_404") == 0) return parse_int(value, &cfg->error_ttl_404);
+    if(strcmp(key, "error_ttl_5xx") == 0) return parse_int(value, &cfg->error_ttl_5xx);
+    if(strcmp(key, "peers") == 0) return parse_string(value, cfg->peers, sizeof(cfg->peers));
+    if(strcmp(key, "peer_self") == 0) return parse_string(value, cfg->peer_self, sizeof(cfg->peer_self));
+    if(strcmp(key, "slow_request_ms") == 0) return parse_int(value, &cfg->slow_request_ms);
+    if(strcmp(key, "slow_log") == 0) return parse_string(value, cfg->slow_log, sizeof(cfg->slow_log));
+    if(strcmp(key, "trace_file") == 0) return parse_string(value, cfg->trace_file, sizeof(cfg->trace_file));
+    if(strcmp(key, "trace_sample") == 0) return parse_int(value, &cfg->trace_sample);
+    if(strcmp(key, "capture_file") == 0) return parse_string(value, cfg->capture_file, sizeof(cfg->capture_file));
+    if(strcmp(key, "capture_salt") == 0) return parse_string(value, cfg->capture_salt, sizeof(cfg->capture_salt));
+    if(strcmp(key, "client_rate") == 0) return parse_int(value, &cfg->client_rate);
+    if(strcmp(key, "client_burst") == 0) return parse_int(value, &cfg->client_burst);
+    if(strcmp(key, "client_max_active") == 0) return parse_int(value, &cfg->client_max_active);
+    if(strcmp(key, "queue_target_ms") == 0) return parse_int(value, &cfg->queue_target_ms);
+    if(strcmp(key, "queue_interval_ms") == 0) return parse_int(value, &cfg->queue_interval_ms);
+    if(strcmp(key, "drain_timeout") == 0) return parse_int(value, &cfg->drain_timeout);
+    return -2;
+}
+
+// Parse path on top of *cfg. On any error *cfg is left untouched.
+int config_load(const char *path, proxy_config *cfg) {
+    FILE *fp = fopen(path, "r");
+    if(!fp) {
+        perror(path);
+        return -1;
+    }
+    
+    proxy_config next = *cfg;
+    char line[1024];
+    int lineno = 0, errors = 0;
+    
+    while(fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if(hash) *hash = '\0';
+        trim_whitespace(line);
+        if(line[0] == '\0') continue;
+        
+        char *eq = strchr(line, '=');
+        if(!eq) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, lineno);
+            errors++;
+            continue;
+        }
+        *eq = '\0';
+        char *key = line;
+        char *value = eq + 1;
+        trim_whitespace(key);
+        trim_whitespace(value);
+        
+        int ret = apply_key(&next, key, value);
+        if(ret == -2) {
+            fprintf(stderr, "%s:%d: unknown key '%s'\n", path, lineno, key);
+            errors++;
+        } else if(ret < 0) {
+            fprintf(stderr, "%s:%d: invalid value for '%s'\n", path, lineno, key);
+            errors++;
+        }
+    }
+    fclose(fp);
+    
+    if(next.buffer_size < 1024 || next.max_clients < 1 || next.response_window < 0 ||
+       next.cache_max_element_bytes > next.cache_max_bytes) {
+        fprintf(stderr, "%s: buffer_size >= 1024, max_clients >= 1 and "
+                "cache_max_element_bytes <= cache_max_bytes are required\n", path);
+        errors++;
+    }
+    if(errors) return -1;
+    
+    *cfg = next;
+    return 0;
+}
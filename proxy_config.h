@@ -0,0 +1,71 @@
+#ifndef PROXY_CONFIG_H
+#define PROXY_CONFIG_H
+
+// Runtime configuration: compiled-in defaults, overridden by an optional
+// "key = value" config file and command-line options. The file is re-read
+// on SIGHUP; startup-only keys (port, listeners, io_uring, upgrade) are ignored then.
+
+#define MAX_BYTES 8192
+#define MAX_CLIENTS 400
+
+// Bits for cacheable_methods
+#define METHOD_GET     (1 << 0)
+#define METHOD_HEAD    (1 << 1)
+#define METHOD_POST    (1 << 2)
+#define METHOD_PUT     (1 << 3)
+#define METHOD_PATCH   (1 << 4)
+#define METHOD_DELETE  (1 << 5)
+#define METHOD_OPTIONS (1 << 6)
+
+typedef struct proxy_config {
+    // Startup only
+    int port_number;
+    int reuseport_mode;             // one SO_REUSEPORT listener per core
+    int defer_accept_secs;          // TCP_DEFER_ACCEPT timeout, 0 = off
+    int uring_mode;                 // io_uring for accept and the response relay
+    int refresh_workers;            // background revalidation threads, 0 = off
+    int admin_port;                 // loopback-only cache admin API, 0 = off
+    char upgrade_socket[108];       // Unix socket path for hot restarts, empty = off
+    long upgrade_cache_bytes;       // hottest cache entries taken over on -U, 0 = none
+    
+    // Reloadable
+    long cache_max_bytes;           // total cache budget
+    long cache_max_element_bytes;   // largest single cached response
+    int max_clients;                // concurrent worker threads
+    int max_tunnels;                // concurrent CONNECT tunnels
+    int buffer_size;                // request buffer and relay chunk size
+    int response_window;            // max unsent bytes buffered for uncacheable responses
+    int connect_timeout_ms;         // whole connect race, all addresses
+    int read_timeout_ms;            // max wait for upstream/client data
+    int write_timeout_ms;           // max wait for a send to make progress
+    int tunnel_idle_timeout;        // seconds
+    int cacheable_methods;          // METHOD_* bits
+    int default_ttl;                // freshness when the origin gives no max-age, seconds
+    int stale_while_revalidate;     // serve-stale-and-refresh window past expiry, seconds
+    int stale_if_error;             // serve-stale-on-origin-failure window past expiry, seconds
+    int connect_failure_ttl;        // fail fast after an origin failed to resolve/connect, seconds
+    int error_ttl_404;              // cache lifetime of 404/410 responses, seconds, 0 = off
+    int error_ttl_5xx;              // cache lifetime of 500/502/503/504 responses, seconds, 0 = off
+    char peers[1024];               // sibling proxies "host:port, ...", same list on every node
+    char peer_self[272];            // this node's entry in peers
+    int slow_request_ms;            // log requests slower than this in full, 0 = off
+    char slow_log[256];             // slow-request log file, empty = stdout
+    char trace_file[256];           // binary trace records, empty = off
+    int trace_sample;               // record 1 in trace_sample requests
+    char capture_file[256];         // anonymized JSONL traffic capture, empty = off
+    char capture_salt[64];          // URL anonymization salt, empty = random per capture
+    int client_rate;                // requests per second per client IP, 0 = unlimited
+    int client_burst;               // requests a client IP may make at once on top of the rate
+    int client_max_active;          // concurrent requests per client IP, 0 = unlimited
+    int queue_target_ms;            // worker slot wait that counts as queueing, 0 = never shed
+    int queue_interval_ms;          // how long waits must stay over target before shedding
+    int drain_timeout;              // seconds in-flight work may run after a hot restart
+} proxy_config;
+
+extern proxy_config config;
+
+void config_defaults(proxy_config *cfg);
+int config_load(const char *path, proxy_config *cfg);
+int config_method_bit(const char *method);
+
+#endif // PROXY_CONFIG_H
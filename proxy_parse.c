@@ -138,18 +138,16 @@ int ParsedRequest_parse(ParsedRequest* pr, const char* buffer, int buflen) {
     // Null terminate headers section
     *headers_end = '\0';
     
-    // Parse request line
+    // Parse request line (a request with no headers ends at headers_end)
     char* line_end = strstr(buf_copy, "\r\n");
-    if (!line_end) {
-        free(buf_copy);
-        return -1;
-    }
+    if (!line_end) line_end = headers_end;
     *line_end = '\0';
     
     // Parse method, URL, version
-    char* method = strtok(buf_copy, " ");
-    char* url = strtok(NULL, " ");
-    char* version = strtok(NULL, " \r\n");
+    char* saveptr = NULL;
+    char* method = strtok_r(buf_copy, " ", &saveptr);
+    char* url = strtok_r(NULL, " ", &saveptr);
+    char* version = strtok_r(NULL, " \r\n", &saveptr);
     
     if (!method || !url || !version) {
         free(buf_copy);
@@ -207,7 +205,33 @@ int ParsedRequest_parse(ParsedRequest* pr, const char* buffer, int buflen) {
         
         pr->host = malloc(strlen(host_start) + 1);
         if (pr->host) strcpy(pr->host, host_start);
-        
+
+    } else if (strcmp(pr->method, "CONNECT") == 0) {
+        // Authority form: host:port (port defaults to 443)
+        pr->path = malloc(strlen(url_copy) + 1);
+        if (pr->path) strcpy(pr->path, url_copy);
+
+        // IPv6 literals come bracketed, [::1]:443; getaddrinfo wants them bare
+        char* host_start = url_copy;
+        char* host_end = NULL;
+        if (url_copy[0] == '[' && (host_end = strchr(url_copy, ']')) != NULL) {
+            host_start = url_copy + 1;
+            *host_end = '\0';
+        }
+
+        char* port_start = strrchr(host_end ? host_end + 1 : url_copy, ':');
+        if (port_start) {
+            pr->port = malloc(strlen(port_start + 1) + 1);
+            if (pr->port) strcpy(pr->port, port_start + 1);
+            *port_start = '\0';
+        } else {
+            pr->port = malloc(4);
+            if (pr->port) strcpy(pr->port, "443");
+        }
+
+        pr->host = malloc(strlen(host_start) + 1);
+        if (pr->host) strcpy(pr->host, host_start);
+
     } else {
         // Relative path
         pr->path = malloc(strlen(url_copy) + 1);
@@ -219,9 +243,12 @@ int ParsedRequest_parse(ParsedRequest* pr, const char* buffer, int buflen) {
     
     free(url_copy);
     
-    // Parse headers
-    char* headers_start = line_end + 2;  // Skip past request line
-    char* header_line = strtok(headers_start, "\r\n");
+    // Parse headers. With none, line_end is headers_end and what follows
+    // is already the body; it must not be read as headers.
+    char* header_line = NULL;
+    if (line_end != headers_end) {
+        header_line = strtok_r(line_end + 2, "\r\n", &saveptr);
+    }
     
     while (header_line) {
         char* colon = strchr(header_line, ':');
@@ -251,7 +278,7 @@ int ParsedRequest_parse(ParsedRequest* pr, const char* buffer, int buflen) {
             // Add to headers list
             ParsedHeader_set(pr, name, value);
         }
-        header_line = strtok(NULL, "\r\n");
+        header_line = strtok_r(NULL, "\r\n", &saveptr);
     }
     
     free(buf_copy);
@@ -378,4 +405,221 @@ int ParsedRequest_unparse(ParsedRequest* pr, char* buffer, size_t buflen) {
     }
     
     return 0;
-}
\ No newline at end of file
+}
+
+// Create new ParsedResponse
+ParsedResponse* ParsedResponse_create() {
+    return calloc(1, sizeof(ParsedResponse));
+}
+
+// Destroy ParsedResponse
+void ParsedResponse_destroy(ParsedResponse* resp) {
+    if (!resp) return;
+    
+    ParsedHeader* current = resp->headers;
+    while (current) {
+        ParsedHeader* next = current->next;
+        ParsedHeader_destroy(current);
+        current = next;
+    }
+    
+    free(resp);
+}
+
+// Parse response status line and headers from the start of buffer
+int ParsedResponse_parse(ParsedResponse* resp, const char* buffer, size_t buflen) {
+    if (!resp || !buffer) return -1;
+    
+    // Find headers end without relying on NUL termination
+    const char* headers_end = NULL;
+    for (size_t i = 0; i + 3 < buflen; i++) {
+        if (buffer[i] == '\r' && buffer[i + 1] == '\n' &&
+            buffer[i + 2] == '\r' && buffer[i + 3] == '\n') {
+            headers_end = buffer + i;
+            break;
+        }
+    }
+    if (!headers_end) return 1;
+    
+    size_t head_len = headers_end - buffer;
+    char* head = malloc(head_len + 1);
+    if (!head) return -1;
+    memcpy(head, buffer, head_len);
+    head[head_len] = '\0';
+    
+    // Status line: HTTP/1.x SP code SP reason
+    char* line_end = strstr(head, "\r\n");
+    if (line_end) *line_end = '\0';
+    
+    char version[MAX_VERSION_LEN];
+    int status = 0;
+    if (sscanf(head, "%15s %d", version, &status) != 2 ||
+        strncmp(version, "HTTP/1.", 7) != 0 || status < 100 || status > 999) {
+        free(head);
+        return -1;
+    }
+    strcpy(resp->version, version);
+    resp->status = status;
+    resp->header_length = head_len + 4;
+    
+    // Headers
+    char* saveptr = NULL;
+    char* header_line = line_end ? strtok_r(line_end + 2, "\r\n", &saveptr) : NULL;
+    while (header_line) {
+        char* colon = strchr(header_line, ':');
+        if (colon) {
+            *colon = '\0';
+            char* name = header_line;
+            char* value = colon + 1;
+            
+            trim_whitespace(name);
+            trim_whitespace(value);
+            
+            ParsedHeader* header = ParsedHeader_create();
+            if (header) {
+                strncpy(header->name, name, MAX_HEADER_NAME_LEN - 1);
+                strncpy(header->value, value, MAX_HEADER_VALUE_LEN - 1);
+                header->next = resp->headers;
+                resp->headers = header;
+            }
+        }
+        header_line = strtok_r(NULL, "\r\n", &saveptr);
+    }
+    
+    free(head);
+    return 0;
+}
+
+// Get response header value
+char* ParsedResponse_get_header(ParsedResponse* resp, const char* name) {
+    if (!resp || !name) return NULL;
+    
+    ParsedHeader* current = resp->headers;
+    while (current) {
+        if (strcasecmp(current->name, name) == 0) {
+            return current->value;
+        }
+        current = current->next;
+    }
+    
+    return NULL;
+}
+
+enum { CHUNK_SIZE_START, CHUNK_SIZE, CHUNK_EXT, CHUNK_DATA, CHUNK_DATA_END, TRAILER_START, TRAILER_LINE };
+
+int ResponseFraming_init(ResponseFraming* f, ParsedResponse* resp, const char* method) {
+    memset(f, 0, sizeof(*f));
+    f->mode = FRAMING_CLOSE;
+    f->content_length = -1;
+    
+    // Interim 1xx responses are followed by another head; read to close
+    if (resp->status >= 100 && resp->status < 200) return 0;
+    
+    if (strcmp(method, "HEAD") == 0 || resp->status == 204 || resp->status == 304) {
+        f->mode = FRAMING_NONE;
+        f->done = 1;
+        return 0;
+    }
+    
+    // Transfer-Encoding overrides Content-Length; unless chunked comes
+    // last, only the close marks the end
+    char* te = ParsedResponse_get_header(resp, "Transfer-Encoding");
+    if (te) {
+        size_t len = strlen(te);
+        while (len > 0 && (te[len - 1] == ' ' || te[len - 1] == '\t')) len--;
+        if (len >= 7 && strncasecmp(te + len - 7, "chunked", 7) == 0 &&
+            (len == 7 || te[len - 8] == ',' || te[len - 8] == ' ')) {
+            f->mode = FRAMING_CHUNKED;
+        }
+        return 0;
+    }
+    
+    char* cl = ParsedResponse_get_header(resp, "Content-Length");
+    if (cl) {
+        char* end = NULL;
+        long long length = strtoll(cl, &end, 10);
+        if (end == cl || *end != '\0' || length < 0 || !isdigit((unsigned char)cl[0])) return -1;
+        
+        f->mode = FRAMING_LENGTH;
+        f->content_length = length;
+        f->remaining = length;
+        f->done = length == 0;
+    }
+    return 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+size_t ResponseFraming_feed(ResponseFraming* f, const char* buf, size_t len) {
+    if (f->done || f->error) return 0;
+    if (f->mode == FRAMING_CLOSE) return len;
+    
+    if (f->mode == FRAMING_LENGTH) {
+        size_t take = (long long)len < f->remaining ? len : (size_t)f->remaining;
+        f->remaining -= take;
+        f->done = f->remaining == 0;
+        return take;
+    }
+    
+    // Chunked: size [; ext] CRLF data CRLF ... 0 CRLF [trailers] CRLF
+    size_t i = 0;
+    while (i < len && !f->done && !f->error) {
+        char c = buf[i];
+        int v;
+        switch (f->state) {
+            case CHUNK_SIZE_START:
+            case CHUNK_SIZE:
+                v = hex_value(c);
+                if (v >= 0) {
+                    if (f->remaining > (0x7fffffffffffffffLL >> 4)) {
+                        f->error = 1;
+                        break;
+                    }
+                    f->remaining = f->remaining * 16 + v;
+                    f->state = CHUNK_SIZE;
+                    i++;
+                } else if (f->state == CHUNK_SIZE_START) {
+                    f->error = 1;
+                } else {
+                    f->state = CHUNK_EXT;
+                }
+                break;
+                
+            case CHUNK_EXT:
+                i++;
+                if (c == '\n') f->state = f->remaining > 0 ? CHUNK_DATA : TRAILER_START;
+                break;
+                
+            case CHUNK_DATA: {
+                size_t take = (long long)(len - i) < f->remaining ? len - i : (size_t)f->remaining;
+                i += take;
+                f->remaining -= take;
+                if (f->remaining == 0) f->state = CHUNK_DATA_END;
+                break;
+            }
+                
+            case CHUNK_DATA_END:
+                i++;
+                if (c == '\n') f->state = CHUNK_SIZE_START;
+                else if (c != '\r') f->error = 1;
+                break;
+                
+            case TRAILER_START:
+                i++;
+                if (c == '\n') f->done = 1;
+                else if (c != '\r') f->state = TRAILER_LINE;
+                break;
+                
+            case TRAILER_LINE:
+                i++;
+                if (c == '\n') f->state = TRAILER_START;
+                break;
+        }
+    }
+    return i;
+}
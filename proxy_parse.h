@@ -38,6 +38,27 @@ typedef struct ParsedRequest {
     size_t body_length;                 // Actual body length
 } ParsedRequest;
 
+// Response status line and headers
+typedef struct ParsedResponse {
+    int status;                         // e.g. 200, 404
+    char version[MAX_VERSION_LEN];      // HTTP/1.0 or HTTP/1.1
+    ParsedHeader* headers;              // Linked list of headers
+    size_t header_length;               // Bytes up to and including the blank line
+} ParsedResponse;
+
+// Where a response body ends: Content-Length, chunked transfer coding,
+// no body at all (HEAD, 204, 304) or, failing those, when the server closes
+enum { FRAMING_CLOSE, FRAMING_LENGTH, FRAMING_CHUNKED, FRAMING_NONE };
+
+typedef struct ResponseFraming {
+    int mode;
+    long long content_length;           // -1 unless mode is FRAMING_LENGTH
+    long long remaining;                // body bytes left, or left in the current chunk
+    int state;                          // position in the chunked grammar
+    int done;                           // end of the response reached
+    int error;                          // malformed chunked framing
+} ResponseFraming;
+
 // Function declarations
 ParsedRequest* ParsedRequest_create();
 void ParsedRequest_destroy(ParsedRequest* pr);
@@ -45,6 +66,19 @@ int ParsedRequest_parse(ParsedRequest* pr, const char* buffer, int buflen);
 int ParsedRequest_unparse(ParsedRequest* pr, char* buffer, size_t buflen);
 int ParsedRequest_unparse_headers(ParsedRequest* pr, char* buffer, size_t buflen);
 
+// Response parsing: 0 = parsed, 1 = need more data, -1 = malformed
+ParsedResponse* ParsedResponse_create();
+void ParsedResponse_destroy(ParsedResponse* resp);
+int ParsedResponse_parse(ParsedResponse* resp, const char* buffer, size_t buflen);
+char* ParsedResponse_get_header(ParsedResponse* resp, const char* name);
+
+// Body framing of a parsed response to method: init returns -1 for an
+// invalid Content-Length. feed takes the body bytes in order, split
+// anywhere, and returns how many of them belong to the response; fewer
+// than len means the response ended inside buf.
+int ResponseFraming_init(ResponseFraming* f, ParsedResponse* resp, const char* method);
+size_t ResponseFraming_feed(ResponseFraming* f, const char* buf, size_t len);
+
 // Header manipulation functions
 ParsedHeader* ParsedHeader_create();
 void ParsedHeader_destroy(ParsedHeader* ph);
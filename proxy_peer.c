@@ -0,0 +1,101 @@
+#include "proxy_peer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+static pthread_rwlock_t peer_lock = PTHREAD_RWLOCK_INITIALIZER;
+static peer_addr peers[MAX_PEERS];
+static int peer_count;
+static char self_name[PEER_NAME_LEN];
+
+static int parse_peer(const char *name, peer_addr *peer) {
+    const char *colon = strrchr(name, ':');
+    if(!colon || colon == name || strlen(name) >= PEER_NAME_LEN) return -1;
+    
+    int port = atoi(colon + 1);
+    if(port <= 0 || port > 65535) return -1;
+    
+    snprintf(peer->name, sizeof(peer->name), "%s", name);
+    snprintf(peer->host, sizeof(peer->host), "%.*s", (int)(colon - name), name);
+    peer->port = port;
+    return 0;
+}
+
+int peer_configure(const char *list, const char *self) {
+    peer_addr parsed[MAX_PEERS];
+    int count = 0;
+    
+    char *copy = strdup(list ? list : "");
+    if(!copy) return -1;
+    
+    char *saveptr = NULL;
+    for(char *tok = strtok_r(copy, ", \t", &saveptr); tok; tok = strtok_r(NULL, ", \t", &saveptr)) {
+        if(count == MAX_PEERS || parse_peer(tok, &parsed[count]) < 0) {
+            printf("Invalid or too many peers at '%s'\n", tok);
+            free(copy);
+            return -1;
+        }
+        count++;
+    }
+    free(copy);
+    
+    pthread_rwlock_wrlock(&peer_lock);
+    memcpy(peers, parsed, count * sizeof(peer_addr));
+    peer_count = count;
+    snprintf(self_name, sizeof(self_name), "%s", self ? self : "");
+    pthread_rwlock_unlock(&peer_lock);
+    
+    if(count > 0) printf("Peering with %d nodes as %s\n", count, self_name[0] ? self_name : "(client only)");
+    return 0;
+}
+
+// Rendezvous score of peer for key: FNV-1a over both, then a 64-bit
+// finalizer so similar names still spread evenly
+static uint64_t peer_score(const char *peer, const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(const char *c = peer; *c; c++) hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+    for(const char *c = key; *c; c++) hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+int peer_route(const char *key, peer_addr *out, int max) {
+    uint64_t scores[MAX_PEERS];
+    int order[MAX_PEERS];
+    int count = 0;
+    
+    pthread_rwlock_rdlock(&peer_lock);
+    int n = peer_count;
+    for(int i = 0; i < n; i++) {
+        scores[i] = peer_score(peers[i].name, key);
+        
+        // Insertion sort by descending score
+        int pos = i;
+        while(pos > 0 && scores[order[pos - 1]] < scores[i]) {
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = i;
+    }
+    for(int i = 0; i < n && count < max; i++) {
+        if(!strcmp(peers[order[i]].name, self_name)) break;
+        out[count++] = peers[order[i]];
+    }
+    pthread_rwlock_unlock(&peer_lock);
+    
+    return count;
+}
+
+void peer_self_name(char *out, size_t len) {
+    pthread_rwlock_rdlock(&peer_lock);
+    snprintf(out, len, "%s", self_name);
+    pthread_rwlock_unlock(&peer_lock);
+}
@@ -0,0 +1,32 @@
+#ifndef PROXY_PEER_H
+#define PROXY_PEER_H
+
+// Cooperative caching between sibling proxies. Every node is configured
+// with the same static peer list; rendezvous (highest random weight)
+// hashing over that list names one owner per cache key. A node that misses
+// locally asks the owner instead of the origin, so each object is cached
+// once across the group. If the owner is down the next-ranked peer takes
+// over, the same choice every node makes. Requests between peers carry
+// PEER_HEADER and are never forwarded again.
+
+#include <stddef.h>
+
+#define MAX_PEERS 32
+#define PEER_NAME_LEN 272           // "host:port"
+#define PEER_HEADER "X-Proxy-Peer"
+
+typedef struct peer_addr {
+    char name[PEER_NAME_LEN];
+    char host[PEER_NAME_LEN];
+    int port;
+} peer_addr;
+
+// list is comma/space separated host:port; self names this node's entry.
+// Safe to call again on reload.
+int peer_configure(const char *list, const char *self);
+
+// Peers to try for key, best first, ending before this node's own rank
+int peer_route(const char *key, peer_addr *out, int max);
+void peer_self_name(char *out, size_t len);
+
+#endif // PROXY_PEER_H
@@ -0,0 +1,106 @@
+#include "proxy_refresh.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct refresh_job refresh_job;
+struct refresh_job {
+    char *key;
+    char *method;
+    int running;                    // picked up by a worker
+    refresh_job *next;
+};
+
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+static refresh_job *jobs;           // oldest first; finished jobs are unlinked
+static int job_count;
+static int refresh_started;
+static refresh_fetch_fn refresh_fetch;
+
+static void *refresh_worker(void *arg) {
+    (void)arg;
+    
+    for(;;) {
+        pthread_mutex_lock(&refresh_lock);
+        refresh_job *job;
+        for(;;) {
+            for(job = jobs; job != NULL && job->running; job = job->next);
+            if(job) break;
+            pthread_cond_wait(&refresh_cond, &refresh_lock);
+        }
+        job->running = 1;
+        pthread_mutex_unlock(&refresh_lock);
+        
+        int result = refresh_fetch(job->key, job->method);
+        printf("Background refresh %s (%s)\n", result < 0 ? "failed" : "done", job->method);
+        
+        pthread_mutex_lock(&refresh_lock);
+        refresh_job **link = &jobs;
+        while(*link != job) link = &(*link)->next;
+        *link = job->next;
+        job_count--;
+        pthread_mutex_unlock(&refresh_lock);
+        
+        free(job->key);
+        free(job->method);
+        free(job);
+    }
+    return NULL;
+}
+
+int refresh_init(int workers, refresh_fetch_fn fetch) {
+    refresh_fetch = fetch;
+    
+    for(int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, refresh_worker, NULL) != 0) {
+            printf("Failed to start refresh worker %d\n", i);
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    refresh_started = workers > 0;
+    return 0;
+}
+
+// Queue a refresh of key; returns 1 if queued, 0 if already pending or full
+int refresh_schedule(const char *key, const char *method) {
+    if(!refresh_started) return 0;
+    
+    pthread_mutex_lock(&refresh_lock);
+    refresh_job **link = &jobs;
+    for(; *link != NULL; link = &(*link)->next) {
+        if(!strcmp((*link)->key, key) && !strcmp((*link)->method, method)) {
+            pthread_mutex_unlock(&refresh_lock);
+            return 0;
+        }
+    }
+    if(job_count >= REFRESH_QUEUE_MAX) {
+        pthread_mutex_unlock(&refresh_lock);
+        printf("Refresh queue full, skipping\n");
+        return 0;
+    }
+    
+    refresh_job *job = (refresh_job*)calloc(1, sizeof(refresh_job));
+    if(job) {
+        job->key = strdup(key);
+        job->method = strdup(method);
+    }
+    if(!job || !job->key || !job->method) {
+        if(job) {
+            free(job->key);
+            free(job->method);
+            free(job);
+        }
+        pthread_mutex_unlock(&refresh_lock);
+        return 0;
+    }
+    
+    *link = job;
+    job_count++;
+    pthread_cond_signal(&refresh_cond);
+    pthread_mutex_unlock(&refresh_lock);
+    return 1;
+}
@@ -0,0 +1,16 @@
+#ifndef PROXY_REFRESH_H
+#define PROXY_REFRESH_H
+
+// Background revalidation: a stale cache entry is served as-is while one of
+// a small pool of refresh threads re-fetches it. Keys already queued or being
+// fetched are not queued again, so a hot stale entry costs one origin request.
+
+#define REFRESH_QUEUE_MAX 1024      // pending + in-flight refreshes
+
+// Re-fetches key and refills the cache; returns <0 on failure
+typedef int (*refresh_fetch_fn)(const char *key, const char *method);
+
+int refresh_init(int workers, refresh_fetch_fn fetch);
+int refresh_schedule(const char *key, const char *method);
+
+#endif // PROXY_REFRESH_H
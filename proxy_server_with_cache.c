@@ -1,10 +1,24 @@
+#define _GNU_SOURCE
 #include "proxy_parse.h"
+#include "proxy_cache.h"
+#include "proxy_tunnel.h"
+#include "proxy_uring.h"
+#include "proxy_config.h"
+#include "proxy_refresh.h"
+#include "proxy_admin.h"
+#include "proxy_peer.h"
+#include "proxy_trace.h"
+#include "proxy_capture.h"
+#include "proxy_admission.h"
+#include "proxy_upgrade.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -13,71 +27,199 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <sched.h>
 
-#define MAX_BYTES 8192
-#define MAX_CLIENTS 400
-#define MAX_SIZE 200*(1<<20)
-#define MAX_ELEMENT_SIZE 10*(1<<20)
+#define MAX_CONNECT_ADDRS 16
+#define HAPPY_EYEBALLS_DELAY_MS 250
 
-typedef struct cache_element cache_element;
-struct cache_element
-{
-    char *data;
-    int len;
-    char *url;
-    char *method;
-    time_t lru_time_track;
-    cache_element *next;
-};
+// Failure codes returned by connectRemoteServer() and handle_request()
+#define PROXY_ERR -1                // generic failure, answered with 500
+#define PROXY_ERR_TIMEOUT -2        // upstream connect/read timed out, 504
+#define PROXY_ERR_UNREACHABLE -3    // DNS failure or every address refused, 502
+#define PROXY_ERR_ORIGIN -4         // origin failed before any byte reached the client
+
+#define CACHE_IF_SHARED 2           // relay cacheable flag: only if public/s-maxage/must-revalidate
 
-cache_element *find(char *url, char *method);
-int add_cache_element(char *data, int size, char *url, char *method);
-void remove_cache_element();
+typedef struct client_conn {
+    int socket;
+    struct sockaddr_in addr;
+    uint64_t accepted_ns;           // trace start
+    int admission_tracked;          // counted against addr until admission_release()
+} client_conn;
+
+typedef struct listener {
+    int socketId;
+    int cpu;                        // CPU this accept loop and its workers run on, -1 = any
+    pthread_t thread;
+} listener;
 
-int port_number = 8080;
 int proxy_socketId;
-pthread_t tid[MAX_CLIENTS];
-sem_t semaphore;
-pthread_mutex_t lock;
-cache_element *head;
-int cache_size;
+const char *config_path = NULL;     // -f: re-read on SIGHUP
 
-int connectRemoteServer(char* host_addr, int port_num)
+// Worker admission: a counter and condition variable rather than a
+// semaphore so max_clients can change on reload
+pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+int active_workers = 0;
+int live_workers = 0;               // spawned and not yet released, slot or not
+int draining = 0;                   // a new process took over: stop accepting
+
+long long monotonic_ms()
 {
-    int remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if(remoteSocket < 0)
-    {
-        printf("Error in Creating Socket.\n");
-        return -1;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void set_socket_timeouts(int socketId)
+{
+    struct timeval tv;
+    
+    tv.tv_sec = config.read_timeout_ms / 1000;
+    tv.tv_usec = (config.read_timeout_ms % 1000) * 1000;
+    setsockopt(socketId, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    
+    tv.tv_sec = config.write_timeout_ms / 1000;
+    tv.tv_usec = (config.write_timeout_ms % 1000) * 1000;
+    setsockopt(socketId, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Resolve host_addr and race non-blocking connects across every address,
+// Happy Eyeballs style: families alternate starting with IPv6, a new attempt
+// starts every HAPPY_EYEBALLS_DELAY_MS (or as soon as one fails), and the
+// first socket to connect wins. Returns a blocking socket with TCP_NODELAY
+// and read/write timeouts set, PROXY_ERR_TIMEOUT or PROXY_ERR_UNREACHABLE.
+int connect_race(char* host_addr, int port_num)
+{
+    struct addrinfo hints, *res = NULL;
+    char port_str[8];
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port_num);
     
-    struct hostent *host = gethostbyname(host_addr);
-    if(host == NULL)
+    int gai = getaddrinfo(host_addr, port_str, &hints, &res);
+    trace_mark(TRACE_DNS);
+    if(gai != 0 || res == NULL)
     {
         fprintf(stderr, "No such host exists: %s\n", host_addr);
-        close(remoteSocket);
-        return -1;
+        return PROXY_ERR_UNREACHABLE;
     }
     
-    struct sockaddr_in server_addr;
-    bzero((char*)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_num);
-    memcpy((char *)&server_addr.sin_addr.s_addr, (char *)host->h_addr_list[0], host->h_length);
+    // Interleave address families, IPv6 first
+    struct addrinfo *v6[MAX_CONNECT_ADDRS], *v4[MAX_CONNECT_ADDRS];
+    struct addrinfo *order[MAX_CONNECT_ADDRS];
+    int n6 = 0, n4 = 0, count = 0;
+    for(struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        if(ai->ai_family == AF_INET6 && n6 < MAX_CONNECT_ADDRS) v6[n6++] = ai;
+        else if(ai->ai_family == AF_INET && n4 < MAX_CONNECT_ADDRS) v4[n4++] = ai;
+    }
+    for(int i = 0; count < MAX_CONNECT_ADDRS && (i < n6 || i < n4); i++) {
+        if(i < n6) order[count++] = v6[i];
+        if(i < n4 && count < MAX_CONNECT_ADDRS) order[count++] = v4[i];
+    }
+    
+    struct pollfd attempts[MAX_CONNECT_ADDRS];
+    int inflight = 0, next = 0, winner = -1;
+    long long now = monotonic_ms();
+    long long deadline = now + config.connect_timeout_ms;
+    long long next_attempt_at = now;
+    
+    while(winner < 0 && now < deadline) {
+        if(next < count && (inflight == 0 || now >= next_attempt_at)) {
+            struct addrinfo *ai = order[next++];
+            next_attempt_at = now + HAPPY_EYEBALLS_DELAY_MS;
+            
+            int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if(fd < 0) continue;
+            if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                winner = fd;
+            } else if(errno == EINPROGRESS) {
+                attempts[inflight].fd = fd;
+                attempts[inflight].events = POLLOUT;
+                attempts[inflight].revents = 0;
+                inflight++;
+            } else {
+                close(fd);
+                next_attempt_at = now;
+            }
+            continue;
+        }
+        if(inflight == 0) break;    // every address failed outright
+        
+        long long wait = deadline - now;
+        if(next < count && next_attempt_at - now < wait) wait = next_attempt_at - now;
+        
+        if(poll(attempts, inflight, (int)wait) > 0) {
+            for(int i = 0; i < inflight && winner < 0; i++) {
+                if(attempts[i].revents == 0) continue;
+                
+                int err = 0;
+                socklen_t errlen = sizeof(err);
+                getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if(err == 0) {
+                    winner = attempts[i].fd;
+                    attempts[i] = attempts[--inflight];
+                } else {
+                    close(attempts[i].fd);
+                    attempts[i--] = attempts[--inflight];
+                    next_attempt_at = 0;    // start the next address right away
+                }
+            }
+        }
+        now = monotonic_ms();
+    }
     
-    if(connect(remoteSocket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0)
+    for(int i = 0; i < inflight; i++) close(attempts[i].fd);
+    freeaddrinfo(res);
+    
+    if(winner < 0)
     {
-        fprintf(stderr, "Error in connecting to %s:%d\n", host_addr, port_num);
-        close(remoteSocket);
-        return -1;
+        fprintf(stderr, "Error in connecting to %s:%d%s\n", host_addr, port_num,
+                now >= deadline ? " (timed out)" : "");
+        return now >= deadline ? PROXY_ERR_TIMEOUT : PROXY_ERR_UNREACHABLE;
     }
     
-    return remoteSocket;
+    trace_mark(TRACE_CONNECT);
+    fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+    int nodelay = 1;
+    setsockopt(winner, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    set_socket_timeouts(winner);
+    
+    return winner;
 }
 
-int sendErrorMessage(int socket, int status_code)
+// connect_race() behind a short-lived negative cache: once an origin fails
+// to resolve or connect, requests for it fail fast for connect_failure_ttl
+// seconds instead of each spending a worker on the same doomed attempt
+int connectRemoteServer(char* host_addr, int port_num)
+{
+    int failed = origin_failure_lookup(host_addr, port_num);
+    if(failed < 0) {
+        printf("Origin %s:%d failed recently, not retrying yet\n", host_addr, port_num);
+        return failed;
+    }
+    
+    int result = connect_race(host_addr, port_num);
+    if(result < 0) {
+        origin_failure_record(host_addr, port_num, result,
+                              __atomic_load_n(&config.connect_failure_ttl, __ATOMIC_RELAXED));
+    }
+    return result;
+}
+
+// As sendErrorMessage, with a Retry-After header when retry_after > 0
+int sendErrorMessageRetryAfter(int socket, int status_code, int retry_after)
 {
+    trace_status(status_code);
+    
+    char extra[48] = "";
+    if(retry_after > 0) snprintf(extra, sizeof(extra), "Retry-After: %d\r\n", retry_after);
+    
     char str[1024];
     char currentTime[50];
     time_t now = time(0);
@@ -93,9 +235,9 @@ int sendErrorMessage(int socket, int status_code)
                 "Connection: close\r\n"
                 "Content-Type: text/html\r\n"
                 "Date: %s\r\n"
-                "Server: ProxyServer/1.0\r\n\r\n"
+                "Server: ProxyServer/1.0\r\n%s\r\n"
                 "<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n"
-                "<BODY><H1>400 Bad Request</H1>\n</BODY></HTML>", currentTime);
+                "<BODY><H1>400 Bad Request</H1>\n</BODY></HTML>", currentTime, extra);
             break;
             
         case 404: 
@@ -105,9 +247,21 @@ int sendErrorMessage(int socket, int status_code)
                 "Content-Type: text/html\r\n"
                 "Connection: close\r\n"
                 "Date: %s\r\n"
-                "Server: ProxyServer/1.0\r\n\r\n"
+                "Server: ProxyServer/1.0\r\n%s\r\n"
                 "<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n"
-                "<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
+                "<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime, extra);
+            break;
+            
+        case 429: 
+            snprintf(str, sizeof(str), 
+                "HTTP/1.1 429 Too Many Requests\r\n"
+                "Content-Length: 107\r\n"
+                "Connection: close\r\n"
+                "Content-Type: text/html\r\n"
+                "Date: %s\r\n"
+                "Server: ProxyServer/1.0\r\n%s\r\n"
+                "<HTML><HEAD><TITLE>429 Too Many Requests</TITLE></HEAD>\n"
+                "<BODY><H1>429 Too Many Requests</H1>\n</BODY></HTML>", currentTime, extra);
             break;
             
         case 500: 
@@ -117,9 +271,9 @@ int sendErrorMessage(int socket, int status_code)
                 "Connection: close\r\n"
                 "Content-Type: text/html\r\n"
                 "Date: %s\r\n"
-                "Server: ProxyServer/1.0\r\n\r\n"
+                "Server: ProxyServer/1.0\r\n%s\r\n"
                 "<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n"
-                "<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
+                "<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime, extra);
             break;
             
         case 501: 
@@ -129,9 +283,45 @@ int sendErrorMessage(int socket, int status_code)
                 "Connection: close\r\n"
                 "Content-Type: text/html\r\n"
                 "Date: %s\r\n"
-                "Server: ProxyServer/1.0\r\n\r\n"
+                "Server: ProxyServer/1.0\r\n%s\r\n"
                 "<HTML><HEAD><TITLE>501 Not Implemented</TITLE></HEAD>\n"
-                "<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
+                "<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime, extra);
+            break;
+            
+        case 502: 
+            snprintf(str, sizeof(str), 
+                "HTTP/1.1 502 Bad Gateway\r\n"
+                "Content-Length: 95\r\n"
+                "Connection: close\r\n"
+                "Content-Type: text/html\r\n"
+                "Date: %s\r\n"
+                "Server: ProxyServer/1.0\r\n%s\r\n"
+                "<HTML><HEAD><TITLE>502 Bad Gateway</TITLE></HEAD>\n"
+                "<BODY><H1>502 Bad Gateway</H1>\n</BODY></HTML>", currentTime, extra);
+            break;
+            
+        case 503: 
+            snprintf(str, sizeof(str), 
+                "HTTP/1.1 503 Service Unavailable\r\n"
+                "Content-Length: 111\r\n"
+                "Connection: close\r\n"
+                "Content-Type: text/html\r\n"
+                "Date: %s\r\n"
+                "Server: ProxyServer/1.0\r\n%s\r\n"
+                "<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\n"
+                "<BODY><H1>503 Service Unavailable</H1>\n</BODY></HTML>", currentTime, extra);
+            break;
+            
+        case 504: 
+            snprintf(str, sizeof(str), 
+                "HTTP/1.1 504 Gateway Timeout\r\n"
+                "Content-Length: 103\r\n"
+                "Connection: close\r\n"
+                "Content-Type: text/html\r\n"
+                "Date: %s\r\n"
+                "Server: ProxyServer/1.0\r\n%s\r\n"
+                "<HTML><HEAD><TITLE>504 Gateway Timeout</TITLE></HEAD>\n"
+                "<BODY><H1>504 Gateway Timeout</H1>\n</BODY></HTML>", currentTime, extra);
             break;
             
         default: 
@@ -143,22 +333,759 @@ int sendErrorMessage(int socket, int status_code)
     return 1;
 }
 
+int sendErrorMessage(int socket, int status_code)
+{
+    return sendErrorMessageRetryAfter(socket, status_code, 0);
+}
+
 int should_cache(char* method) {
-    return (strcmp(method, "GET") == 0);
+    return (config.cacheable_methods & config_method_bit(method)) != 0;
+}
+
+// Whether the response to request may be stored: never for cookies, and
+// for Authorization only if the response marks itself shared
+int cache_policy(ParsedRequest *request, char *key)
+{
+    if(!key || !should_cache(request->method) || ParsedHeader_get(request, "Cookie")) return 0;
+    return ParsedHeader_get(request, "Authorization") ? CACHE_IF_SHARED : 1;
+}
+
+// Status code of a cached response, 0 if its status line is unreadable
+int cached_status(cache_element *element)
+{
+    char line[16] = {0};
+    int status = 0;
+    memcpy(line, element->chunks->data, element->chunks->len < 15 ? element->chunks->len : 15);
+    sscanf(line, "HTTP/%*d.%*d %d", &status);
+    return status;
+}
+
+// Send a pinned cache entry to the client, chunk by chunk
+void send_cached(int socket, cache_element *element)
+{
+    for(cache_chunk *c = element->chunks; c != NULL; c = c->next) {
+        ssize_t n = send(socket, c->data, c->len, 0);
+        if(n > 0) trace_add_bytes(n);
+        if(n != c->len) break;
+    }
+}
+
+// Cache key for a request: its absolute URL, with the default port left out
+// so "host" and "host:80" share entries. Caller frees.
+char *cache_key(ParsedRequest *request)
+{
+    char *key = NULL;
+    int default_port = !request->port || !strcmp(request->port, "80");
+    if(asprintf(&key, "http://%s%s%s%s", request->host, default_port ? "" : ":",
+                default_port ? "" : request->port, request->path) < 0) {
+        return NULL;
+    }
+    return key;
+}
+
+// Response relay between upstream and client. The buffer lets the two sides
+// run at their own pace: a cacheable response is kept whole (up to the cache
+// element limit), so upstream is read at origin speed, the cache is filled
+// and the origin connection closed as soon as the response ends, and the
+// client drains the buffered copy afterwards. Anything else is relayed
+// through a window of at most response_window unsent bytes.
+//
+// Responses are received straight into CACHE_CHUNK_SIZE cache chunks: a
+// finished fill is handed to the cache without copying, and the sent chunks
+// of an uncached response are freed as the client drains them. Only an
+// uncacheable response on the io_uring path differs: it cycles through the
+// ring's registered arena instead.
+//
+// Nothing is sent until the response head has been inspected: it decides
+// whether and for how long the response is cached and how its end is
+// framed (Content-Length, chunked, or the origin closing), and when the
+// caller holds a stale copy (hold_errors) a 5xx or a failed fetch is
+// swallowed so the stale copy can be served instead. A declared length over
+// the element limit is never buffered for the cache, and a fill that grows
+// past it is dropped on the spot. clientSocket -1 fills the cache only.
+#define RELAY_HEAD_MAX CACHE_CHUNK_SIZE     // the head must fit in the first chunk
+
+typedef struct relay_state {
+    int client;
+    int remote;                     // -1 once the origin side is finished
+    char *data;                     // registered io_uring arena (fixed only)
+    size_t capacity;
+    cache_chunk *first;             // oldest chunk still held
+    cache_chunk *last;
+    cache_chunk *send_chunk;        // chunk holding the next byte to send
+    int send_off;
+    cache_chunk *spare;             // untrimmed last chunk, freed at the end
+    cache_element *filled;          // inserted entry the client still drains
+    size_t len;                     // bytes held in data, or appended to the chunks
+    size_t sent;                    // of those, already sent to the client
+    long long received;
+    size_t chunk;                   // largest single recv
+    size_t window;                  // unsent bytes allowed when not caching
+    long max_cache;                 // largest response that may still be cached
+    int fixed;                      // data is a registered io_uring arena
+    int caching;                    // the chunks still hold the response from byte 0
+    int client_ok;
+    int complete;
+    int timed_out;
+    int head_done;                  // head inspected (or given up on); sending allowed
+    int hold_errors;
+    int origin_error;
+    int authorized;                 // request carried credentials: store only if marked shared
+    ResponseFraming framing;        // where the body ends; close until the head says otherwise
+    time_t expires;                 // freshness of the cached copy, 0 = never expires
+    int stale_while_revalidate;
+    int stale_if_error;
+    long long last_read;
+    long long last_write;
+    char *key;
+    char *method;
+} relay_state;
+
+int relay_init(relay_state *rs, int clientSocket, int remoteSocketID, int cacheable,
+               int hold_errors, char *key, char *method, char *arena, size_t arena_len)
+{
+    memset(rs, 0, sizeof(*rs));
+    rs->client = clientSocket;
+    rs->remote = remoteSocketID;
+    rs->caching = cacheable != 0;
+    rs->authorized = cacheable == CACHE_IF_SHARED;
+    rs->client_ok = clientSocket >= 0;
+    rs->hold_errors = hold_errors;
+    rs->key = key;
+    rs->method = method;
+    rs->last_read = rs->last_write = monotonic_ms();
+    rs->chunk = config.buffer_size;
+    rs->window = config.response_window;
+    rs->max_cache = __atomic_load_n(&cache_max_element_size, __ATOMIC_RELAXED);
+    rs->framing.mode = FRAMING_CLOSE;
+    
+    if(arena && !cacheable) {
+        rs->data = arena;
+        rs->capacity = arena_len;
+        rs->fixed = 1;
+        if(rs->window + rs->chunk > arena_len) {
+            rs->chunk = arena_len / 2;
+            rs->window = arena_len - rs->chunk;
+        }
+    }
+    return 0;
+}
+
+int relay_active(relay_state *rs)
+{
+    return rs->remote >= 0 || (rs->client_ok && rs->sent < rs->len);
+}
+
+int relay_want_read(relay_state *rs)
+{
+    return rs->remote >= 0 && (rs->caching || rs->len - rs->sent < rs->window);
+}
+
+int relay_want_write(relay_state *rs)
+{
+    return rs->client_ok && rs->head_done && rs->sent < rs->len;
+}
+
+void relay_finish_upstream(relay_state *rs)
+{
+    if(rs->remote >= 0) close(rs->remote);
+    rs->remote = -1;
+    
+    // Release whatever is held back, unless a stale copy will stand in
+    if(!rs->head_done && !rs->complete && rs->hold_errors) {
+        rs->origin_error = 1;
+        rs->client_ok = 0;
+        rs->caching = 0;
+    }
+    rs->head_done = 1;
+}
+
+// Free chunks the client is done with, once they are no longer kept for the
+// cache. The chunk being sent from and the one being filled stay.
+void relay_release_sent(relay_state *rs)
+{
+    if(rs->caching || rs->filled) return;
+    while(rs->first && rs->first != rs->send_chunk && rs->first != rs->last) {
+        cache_chunk *done = rs->first;
+        rs->first = done->next;
+        free(done);
+    }
+}
+
+// Make room for the next upstream read and return its size. Compacting the
+// arena moves data, so it is only allowed when can_move is set (no send from
+// it is in flight); otherwise 0 means "not now".
+size_t relay_prepare_read(relay_state *rs, int can_move)
+{
+    if(rs->fixed) {
+        if(rs->capacity - rs->len < rs->chunk) {
+            if(!can_move) return 0;
+            memmove(rs->data, rs->data + rs->sent, rs->len - rs->sent);
+            rs->len -= rs->sent;
+            rs->sent = 0;
+        }
+        return rs->capacity - rs->len < rs->chunk ? rs->capacity - rs->len : rs->chunk;
+    }
+    
+    relay_release_sent(rs);
+    if(!rs->last || rs->last->len == CACHE_CHUNK_SIZE) {
+        cache_chunk *chunk = cache_chunk_alloc();
+        if(!chunk) {
+            printf("Failed to allocate response buffer\n");
+            rs->caching = 0;
+            relay_finish_upstream(rs);
+            return 0;
+        }
+        if(rs->last) rs->last->next = chunk;
+        else rs->first = chunk;
+        rs->last = chunk;
+    }
+    size_t room = CACHE_CHUNK_SIZE - rs->last->len;
+    return room < rs->chunk ? room : rs->chunk;
+}
+
+// Where the next upstream read lands
+char *relay_read_ptr(relay_state *rs)
+{
+    return rs->fixed ? rs->data + rs->len : rs->last->data + rs->last->len;
+}
+
+// The next contiguous run of unsent bytes; returns its length
+size_t relay_send_span(relay_state *rs, char **out)
+{
+    if(rs->fixed) {
+        *out = rs->data + rs->sent;
+        return rs->len - rs->sent;
+    }
+    
+    if(!rs->send_chunk) {
+        rs->send_chunk = rs->first;
+        rs->send_off = 0;
+    }
+    while(rs->send_off == rs->send_chunk->len && rs->send_chunk->next) {
+        rs->send_chunk = rs->send_chunk->next;
+        rs->send_off = 0;
+    }
+    *out = rs->send_chunk->data + rs->send_off;
+    return rs->send_chunk->len - rs->send_off;
+}
+
+// Give the cache a last chunk without the unused tail. The full-size
+// original stays with the relay until the end: a send may still be using it.
+void relay_trim_last(relay_state *rs)
+{
+    cache_chunk *last = rs->last;
+    if(last->len == CACHE_CHUNK_SIZE) return;
+    
+    cache_chunk *trimmed = (cache_chunk*)malloc(sizeof(cache_chunk) + last->len);
+    if(!trimmed) return;
+    memcpy(trimmed->data, last->data, last->len);
+    trimmed->len = last->len;
+    trimmed->next = NULL;
+    
+    if(rs->first == last) {
+        rs->first = trimmed;
+    } else {
+        cache_chunk *prev = rs->first;
+        while(prev->next != last) prev = prev->next;
+        prev->next = trimmed;
+    }
+    rs->last = trimmed;
+    rs->spare = last;
+}
+
+// The response ended where its framing said: insert the fill, stop reading
+void relay_complete(relay_state *rs)
+{
+    rs->complete = 1;
+    if(rs->caching && rs->received > 0) {
+        relay_trim_last(rs);
+        rs->filled = add_cache_element_chunks(rs->first, (int)rs->len, rs->key, rs->method, rs->expires,
+                                              rs->stale_while_revalidate, rs->stale_if_error);
+        if(rs->filled) printf("Response cached successfully (%zu bytes)\n", rs->len);
+        rs->caching = 0;
+    }
+    relay_finish_upstream(rs);
+}
+
+// Pass newly received body bytes through the framing; anything past the
+// end of the response is dropped
+void relay_frame(relay_state *rs, const char *bytes, size_t n)
+{
+    size_t used = ResponseFraming_feed(&rs->framing, bytes, n);
+    
+    if(rs->framing.error) {
+        printf("Malformed chunked response, relaying until close without caching\n");
+        rs->caching = 0;
+        rs->framing.mode = FRAMING_CLOSE;
+        rs->framing.error = 0;
+    } else if(used < n) {
+        printf("Dropping %zu bytes past the end of the response\n", n - used);
+        rs->len -= n - used;
+        if(!rs->fixed) rs->last->len -= n - used;
+    }
+}
+
+int cacheable_status(int status)
+{
+    return status == 200 || status == 203 || status == 300 || status == 301 || status == 308;
+}
+
+// Lifetime of a cached error response, 0 if the status is not negatively cached
+int error_ttl(int status)
+{
+    if(status == 404 || status == 410) return config.error_ttl_404;
+    if(status == 500 || status == 502 || status == 503 || status == 504) return config.error_ttl_5xx;
+    return 0;
+}
+
+// Apply Cache-Control to the cache decision and freshness lifetime
+void relay_apply_cache_control(relay_state *rs, ParsedResponse *resp)
+{
+    long ttl = config.default_ttl, s_maxage = -1;
+    int has_ttl = ttl > 0, shared = 0;
+    rs->stale_while_revalidate = config.stale_while_revalidate;
+    rs->stale_if_error = config.stale_if_error;
+    
+    char *value = ParsedResponse_get_header(resp, "Cache-Control");
+    if(value) {
+        char cc[MAX_HEADER_VALUE_LEN];
+        strncpy(cc, value, sizeof(cc) - 1);
+        cc[sizeof(cc) - 1] = '\0';
+        
+        char *saveptr = NULL;
+        for(char *tok = strtok_r(cc, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+            trim_whitespace(tok);
+            char *eq = strchr(tok, '=');
+            long n = eq ? atol(eq + 1) : 0;
+            if(eq) *eq = '\0';
+            
+            if(!strcasecmp(tok, "no-store") || !strcasecmp(tok, "no-cache") ||
+               !strcasecmp(tok, "private")) {
+                rs->caching = 0;
+            } else if(eq && !strcasecmp(tok, "max-age")) {
+                ttl = n;
+                has_ttl = 1;
+            } else if(eq && !strcasecmp(tok, "s-maxage")) {
+                s_maxage = n;
+                shared = 1;
+            } else if(!strcasecmp(tok, "public") || !strcasecmp(tok, "must-revalidate")) {
+                shared = 1;
+            } else if(eq && !strcasecmp(tok, "stale-while-revalidate")) {
+                rs->stale_while_revalidate = (int)n;
+            } else if(eq && !strcasecmp(tok, "stale-if-error")) {
+                rs->stale_if_error = (int)n;
+            }
+        }
+    }
+    
+    // A response to a request with credentials is that user's unless the
+    // origin says it may be shared
+    if(rs->authorized && !shared) rs->caching = 0;
+    
+    // The key holds only the URL, so a response that varies on anything
+    // but the encoding cannot be told apart from another user's
+    value = ParsedResponse_get_header(resp, "Vary");
+    if(value) {
+        char vary[MAX_HEADER_VALUE_LEN];
+        strncpy(vary, value, sizeof(vary) - 1);
+        vary[sizeof(vary) - 1] = '\0';
+        
+        char *saveptr = NULL;
+        for(char *tok = strtok_r(vary, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+            trim_whitespace(tok);
+            if(tok[0] && strcasecmp(tok, "Accept-Encoding") != 0) rs->caching = 0;
+        }
+    }
+    
+    // A shared cache prefers s-maxage
+    if(s_maxage >= 0) {
+        ttl = s_maxage;
+        has_ttl = 1;
+    }
+    rs->expires = has_ttl ? time(NULL) + (ttl > 0 ? ttl : 0) : 0;
+}
+
+// Inspect the response head once enough of it has arrived; final is set
+// when no more data will come
+void relay_inspect_head(relay_state *rs, int final)
+{
+    if(rs->head_done) return;
+    
+    // Reads never span chunks, so before the head is done it is all in the first
+    char *head = rs->fixed ? rs->data : rs->first ? rs->first->data : NULL;
+    size_t head_len = rs->fixed ? rs->len : rs->first ? (size_t)rs->first->len : 0;
+    
+    ParsedResponse *resp = ParsedResponse_create();
+    int ret = resp && head ? ParsedResponse_parse(resp, head, head_len) : resp ? 1 : -1;
+    
+    if(ret == 1 && !final && head_len < RELAY_HEAD_MAX &&
+       (!rs->fixed || rs->len + rs->chunk <= rs->capacity)) {
+        ParsedResponse_destroy(resp);
+        return;
+    }
+    rs->head_done = 1;
+    
+    if(ret == 0 && !(resp->status >= 500 && rs->hold_errors)) trace_status(resp->status);
+    
+    if(ret != 0) {
+        // No usable head: relay it as-is but never cache it
+        rs->caching = 0;
+    } else if(resp->status >= 500 && rs->hold_errors) {
+        printf("Origin answered %d, holding it back for the stale copy\n", resp->status);
+        rs->origin_error = 1;
+        rs->client_ok = 0;
+        rs->caching = 0;
+    } else if(error_ttl(resp->status) > 0) {
+        // Negative entry: fixed short lifetime, never served stale
+        if(rs->caching) relay_apply_cache_control(rs, resp);
+        rs->expires = time(NULL) + error_ttl(resp->status);
+        rs->stale_while_revalidate = 0;
+        rs->stale_if_error = 0;
+    } else if(!cacheable_status(resp->status)) {
+        rs->caching = 0;
+    } else if(rs->caching) {
+        relay_apply_cache_control(rs, resp);
+    }
+    
+    if(ret == 0 && !rs->origin_error) {
+        if(ResponseFraming_init(&rs->framing, resp, rs->method) < 0) {
+            printf("Invalid Content-Length, relaying until close without caching\n");
+            rs->caching = 0;
+        } else if(rs->caching && rs->framing.mode == FRAMING_LENGTH &&
+                  (long long)resp->header_length + rs->framing.content_length > rs->max_cache) {
+            printf("Content-Length exceeds cache element limit, relaying without caching\n");
+            rs->caching = 0;
+        }
+        relay_frame(rs, head + resp->header_length, head_len - resp->header_length);
+    }
+    ParsedResponse_destroy(resp);
+}
+
+// Account for an upstream read result (n bytes, 0 = EOF, <0 = -errno)
+void relay_on_read(relay_state *rs, ssize_t n)
+{
+    if(n > 0) {
+        if(rs->received == 0) trace_mark(TRACE_FIRST_BYTE);
+        char *bytes = relay_read_ptr(rs);
+        rs->len += n;
+        if(!rs->fixed) rs->last->len += n;
+        rs->received += n;
+        rs->last_read = monotonic_ms();
+        
+        if(rs->head_done) relay_frame(rs, bytes, n);
+        else relay_inspect_head(rs, 0);
+        
+        if(rs->caching && (long)rs->len > rs->max_cache) {
+            printf("Response exceeds cache element limit, relaying without caching\n");
+            rs->caching = 0;
+        }
+        if(rs->origin_error) relay_finish_upstream(rs);
+        else if(rs->framing.done) relay_complete(rs);
+        return;
+    }
+    if(n == -EINTR || n == -EAGAIN) return;
+    
+    if(n < 0) printf("Error receiving data from server: %s\n", strerror((int)-n));
+    if(n == 0) {
+        relay_inspect_head(rs, 1);
+        if(rs->framing.mode == FRAMING_CLOSE) relay_complete(rs);
+        else if(!rs->origin_error) printf("Origin closed before the end of the response\n");
+    }
+    relay_finish_upstream(rs);
+}
+
+// Account for a client send result (n bytes, <0 = -errno)
+void relay_on_write(relay_state *rs, ssize_t n)
+{
+    if(n > 0) {
+        rs->sent += n;
+        if(!rs->fixed) rs->send_off += n;
+        rs->last_write = monotonic_ms();
+        trace_add_bytes(n);
+    } else if(n < 0 && n != -EAGAIN && n != -EINTR) {
+        printf("Error sending data to client: %s\n", strerror((int)-n));
+        rs->client_ok = 0;
+    }
+}
+
+// Apply read/write timeouts to whichever side we are still waiting on.
+// Returns 1 if the upstream side should be abandoned.
+int relay_check_timeouts(relay_state *rs, int waiting_read, int waiting_write)
+{
+    long long now = monotonic_ms();
+    int abandon = 0;
+    
+    if(waiting_read && now - rs->last_read > config.read_timeout_ms) {
+        printf("Upstream read timed out after %lld bytes\n", rs->received);
+        rs->timed_out = 1;
+        abandon = 1;
+    }
+    if(waiting_write && now - rs->last_write > config.write_timeout_ms) {
+        printf("Client write timed out\n");
+        rs->client_ok = 0;
+    } else if(!waiting_write) {
+        rs->last_write = now;
+    }
+    
+    // Without a client or a cache fill there is no reason to keep reading
+    if(!rs->client_ok && !rs->caching) abandon = 1;
+    return abandon;
+}
+
+int relay_result(relay_state *rs)
+{
+    relay_finish_upstream(rs);
+    if(rs->filled) cache_element_release(rs->filled);
+    else cache_chunks_free(rs->first);
+    free(rs->spare);
+    
+    if(rs->timed_out && rs->received == 0) return PROXY_ERR_TIMEOUT;
+    if(rs->origin_error) return PROXY_ERR_ORIGIN;
+    if(!rs->complete) printf("Response relay ended early (%lld bytes received)\n", rs->received);
+    return 0;
+}
+
+int relay_response_poll(int clientSocket, int remoteSocketID, int cacheable, int hold_errors,
+                        char *key, char *method)
+{
+    relay_state rs;
+    if(relay_init(&rs, clientSocket, remoteSocketID, cacheable, hold_errors, key, method, NULL, 0) < 0) {
+        close(remoteSocketID);
+        return PROXY_ERR;
+    }
+    
+    while(relay_active(&rs)) {
+        int want_read = relay_want_read(&rs);
+        int want_write = relay_want_write(&rs);
+        
+        struct pollfd fds[2];
+        int nfds = 0, upstream_idx = -1, client_idx = -1;
+        if(want_read) {
+            fds[nfds].fd = rs.remote;
+            fds[nfds].events = POLLIN;
+            upstream_idx = nfds++;
+        }
+        if(want_write) {
+            fds[nfds].fd = rs.client;
+            fds[nfds].events = POLLOUT;
+            client_idx = nfds++;
+        }
+        
+        int ready = poll(fds, nfds, 1000);
+        if(ready < 0 && errno != EINTR) {
+            perror("Relay poll failed");
+            break;
+        }
+        int read_ready = upstream_idx >= 0 && ready > 0 && fds[upstream_idx].revents;
+        int write_ready = client_idx >= 0 && ready > 0 && fds[client_idx].revents;
+        
+        if(read_ready) {
+            size_t room = relay_prepare_read(&rs, 1);
+            if(room > 0) {
+                ssize_t n = recv(rs.remote, relay_read_ptr(&rs), room, 0);
+                relay_on_read(&rs, n < 0 ? -errno : n);
+            }
+        }
+        if(write_ready && rs.client_ok) {
+            char *out;
+            size_t span = relay_send_span(&rs, &out);
+            ssize_t n = send(rs.client, out, span, MSG_DONTWAIT);
+            relay_on_write(&rs, n < 0 ? -errno : n);
+        }
+        if(relay_check_timeouts(&rs, want_read && !read_ready, want_write && !write_ready)) {
+            relay_finish_upstream(&rs);
+        }
+    }
+    
+    return relay_result(&rs);
+}
+
+#define RELAY_OP_RECV 1
+#define RELAY_OP_SEND 2
+#define RELAY_OP_CANCEL 3
+
+// io_uring flavour of the relay: each round queues the upstream recv and the
+// client send together and waits for either in a single io_uring_enter(),
+// instead of poll() + recv() + send(). Uncacheable responses use the ring's
+// registered arena with READ_FIXED / WRITE_FIXED.
+int relay_response_uring(uring *ring, int clientSocket, int remoteSocketID, int cacheable,
+                         int hold_errors, char *key, char *method)
+{
+    relay_state rs;
+    if(relay_init(&rs, clientSocket, remoteSocketID, cacheable, hold_errors, key, method,
+                  ring->arena, ring->arena_len) < 0) {
+        close(remoteSocketID);
+        return PROXY_ERR;
+    }
+    
+    int recv_inflight = 0, send_inflight = 0, recv_fixed = 0;
+    
+    while(relay_active(&rs) || recv_inflight || send_inflight) {
+        if(!relay_active(&rs) || (recv_inflight && rs.remote < 0)) {
+            // Shutting down: cancel what is left and collect the completions
+            struct io_uring_sqe *sqe;
+            if(recv_inflight && (sqe = uring_get_sqe(ring))) {
+                uring_prep_cancel(sqe, RELAY_OP_RECV, RELAY_OP_CANCEL);
+            }
+            if(send_inflight && !rs.client_ok && (sqe = uring_get_sqe(ring))) {
+                uring_prep_cancel(sqe, RELAY_OP_SEND, RELAY_OP_CANCEL);
+            }
+        } else {
+            if(!recv_inflight && relay_want_read(&rs)) {
+                size_t room = relay_prepare_read(&rs, !send_inflight);
+                struct io_uring_sqe *sqe = room ? uring_get_sqe(ring) : NULL;
+                if(sqe) {
+                    recv_fixed = rs.fixed;
+                    char *in = relay_read_ptr(&rs);
+                    if(recv_fixed) uring_prep_read_fixed(sqe, rs.remote, in, room, RELAY_OP_RECV);
+                    else uring_prep_recv(sqe, rs.remote, in, room, RELAY_OP_RECV);
+                    recv_inflight = 1;
+                }
+            }
+            if(!send_inflight && relay_want_write(&rs)) {
+                struct io_uring_sqe *sqe = uring_get_sqe(ring);
+                if(sqe) {
+                    char *out;
+                    size_t span = relay_send_span(&rs, &out);
+                    if(rs.fixed) uring_prep_write_fixed(sqe, rs.client, out, span, RELAY_OP_SEND);
+                    else uring_prep_send(sqe, rs.client, out, span, RELAY_OP_SEND);
+                    send_inflight = 1;
+                }
+            }
+        }
+        
+        if(uring_enter(ring, 1, 1000) < 0) {
+            perror("io_uring_enter failed");
+            break;
+        }
+        
+        int got_read = 0, got_write = 0;
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek_cqe(ring)) != NULL) {
+            unsigned long long op = cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(ring);
+            
+            if(op == RELAY_OP_RECV) {
+                recv_inflight = 0;
+                got_read = 1;
+                if(rs.remote >= 0) relay_on_read(&rs, res == -ECANCELED ? -EINTR : res);
+            } else if(op == RELAY_OP_SEND) {
+                send_inflight = 0;
+                got_write = 1;
+                if(rs.client_ok) relay_on_write(&rs, res);
+            }
+        }
+        
+        if(relay_check_timeouts(&rs, recv_inflight && rs.remote >= 0 && !got_read,
+                                send_inflight && rs.client_ok && !got_write)) {
+            relay_finish_upstream(&rs);
+        }
+    }
+    
+    // Only a failed io_uring_enter() leaves a recv or send in flight, and
+    // the kernel may still write into (or read from) the buffers. Cancel
+    // them and wait for their completions before anything is freed.
+    for(int tries = 0; (recv_inflight || send_inflight) && tries < 10; tries++) {
+        struct io_uring_sqe *sqe;
+        if(recv_inflight && (sqe = uring_get_sqe(ring))) {
+            uring_prep_cancel(sqe, RELAY_OP_RECV, RELAY_OP_CANCEL);
+        }
+        if(send_inflight && (sqe = uring_get_sqe(ring))) {
+            uring_prep_cancel(sqe, RELAY_OP_SEND, RELAY_OP_CANCEL);
+        }
+        if(uring_enter(ring, 1, 100) < 0) break;
+        
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek_cqe(ring)) != NULL) {
+            if(cqe->user_data == RELAY_OP_RECV) recv_inflight = 0;
+            else if(cqe->user_data == RELAY_OP_SEND) send_inflight = 0;
+            uring_cqe_seen(ring);
+        }
+    }
+    
+    if(recv_inflight || send_inflight) {
+        // Still in flight: leak the ring, its arena and the response
+        // buffers rather than free memory the kernel may yet touch
+        printf("io_uring relay stuck with I/O in flight, abandoning its ring and buffers\n");
+        rs.first = rs.last = rs.spare = NULL;
+        rs.filled = NULL;
+        ring->fd = -1;              // relay_response() frees only the struct
+    }
+    return relay_result(&rs);
+}
+
+int relay_response(int clientSocket, int remoteSocketID, int cacheable, int hold_errors,
+                   char *key, char *method)
+{
+    if(config.uring_mode) {
+        uring *ring = uring_pool_get((size_t)config.response_window + config.buffer_size);
+        if(ring) {
+            int result = relay_response_uring(ring, clientSocket, remoteSocketID, cacheable,
+                                              hold_errors, key, method);
+            if(ring->fd >= 0) {
+                uring_pool_put(ring);
+            } else {
+                free(ring);
+            }
+            return result;
+        }
+    }
+    return relay_response_poll(clientSocket, remoteSocketID, cacheable, hold_errors, key, method);
+}
+
+// Connect to the highest-ranked reachable peer that owns key. Returns -1
+// when this node owns it or every peer ranked above it is down.
+int connect_peer(char *key)
+{
+    peer_addr route[MAX_PEERS];
+    int n = peer_route(key, route, MAX_PEERS);
+    
+    for(int i = 0; i < n; i++) {
+        int peerSocketID = connectRemoteServer(route[i].host, route[i].port);
+        if(peerSocketID >= 0) {
+            printf("Fetching from peer %s\n", route[i].name);
+            return peerSocketID;
+        }
+        printf("Peer %s unavailable, failing over\n", route[i].name);
+    }
+    return -1;
 }
 
-int handle_request(int clientSocket, ParsedRequest *request, char *original_request)
+// Forward request and relay the response, caching it under key (if not
+// NULL); clientSocket -1 only refills the cache. hold_errors is set when a
+// stale copy can stand in for a failure. A cacheable miss is fetched from
+// the key's owning peer when peering is configured; that copy is cached
+// by the owner, not here.
+int handle_request(int clientSocket, ParsedRequest *request, char *key, int hold_errors)
 {
-    char *buf = (char*)malloc(sizeof(char)*MAX_BYTES);
+    size_t buf_size = config.buffer_size;
+    char *buf = (char*)malloc(sizeof(char)*buf_size);
     if(!buf) {
         printf("Memory allocation failed\n");
         return -1;
     }
     
-    // Build request line
+    // Requests from a peer are never forwarded to another peer
+    int from_peer = ParsedHeader_get(request, PEER_HEADER) != NULL;
+    ParsedHeader_remove(request, PEER_HEADER);
+    
+    int remoteSocketID = -1;
+    if(!from_peer && cache_policy(request, key)) {
+        remoteSocketID = connect_peer(key);
+    }
+    int via_peer = remoteSocketID >= 0;
+    if(via_peer) {
+        char self[PEER_NAME_LEN];
+        peer_self_name(self, sizeof(self));
+        ParsedHeader_set(request, PEER_HEADER, self[0] ? self : "client");
+    }
+    
+    // Build request line; a peer is a proxy and gets the absolute URL
     strcpy(buf, request->method);
     strcat(buf, " ");
-    strcat(buf, request->path);
+    strcat(buf, via_peer ? key : request->path);
     strcat(buf, " ");
     strcat(buf, request->version);
     strcat(buf, "\r\n");
@@ -178,7 +1105,7 @@ int handle_request(int clientSocket, ParsedRequest *request, char *original_requ
     }
     
     // Add headers
-    if(ParsedRequest_unparse_headers(request, buf + len, (size_t)MAX_BYTES - len) < 0) {
+    if(ParsedRequest_unparse_headers(request, buf + len, buf_size - len) < 0) {
         printf("Failed to unparse headers\n");
     }
     
@@ -188,11 +1115,13 @@ int handle_request(int clientSocket, ParsedRequest *request, char *original_requ
     if(request->port != NULL)
         server_port = atoi(request->port);
     
-    int remoteSocketID = connectRemoteServer(request->host, server_port);
-    if(remoteSocketID < 0)
-    {
-        free(buf);
-        return -1;
+    if(!via_peer) {
+        remoteSocketID = connectRemoteServer(request->host, server_port);
+        if(remoteSocketID < 0)
+        {
+            free(buf);
+            return remoteSocketID;
+        }
     }
     
     // Send headers to remote server
@@ -217,61 +1146,30 @@ int handle_request(int clientSocket, ParsedRequest *request, char *original_requ
         }
     }
     
-    bzero(buf, MAX_BYTES);
-    
-    // Receive and forward response
-    char *response_buffer = NULL;
-    int total_response_size = 0;
-    int response_capacity = MAX_BYTES;
-    
-    // Only cache GET requests
-    if(should_cache(request->method)) {
-        response_buffer = (char*)malloc(response_capacity);
-        if(!response_buffer) {
-            printf("Failed to allocate response buffer\n");
-        }
-    }
-    
-    int bytes_recv = recv(remoteSocketID, buf, MAX_BYTES-1, 0);
+    free(buf);
     
-    while(bytes_recv > 0)
-    {
-        // Forward to client
-        int bytes_sent_to_client = send(clientSocket, buf, bytes_recv, 0);
-        if(bytes_sent_to_client < 0) {
-            perror("Error sending data to client");
-            break;
-        }
-        
-        // Store for caching (GET requests only)
-        if(response_buffer && should_cache(request->method)) {
-            if(total_response_size + bytes_recv >= response_capacity) {
-                response_capacity *= 2;
-                response_buffer = (char*)realloc(response_buffer, response_capacity);
-                if(!response_buffer) {
-                    printf("Failed to reallocate response buffer\n");
-                    break;
-                }
-            }
-            memcpy(response_buffer + total_response_size, buf, bytes_recv);
-            total_response_size += bytes_recv;
-        }
-        
-        bzero(buf, MAX_BYTES);
-        bytes_recv = recv(remoteSocketID, buf, MAX_BYTES-1, 0);
-    }
+    return relay_response(clientSocket, remoteSocketID, via_peer ? 0 : cache_policy(request, key),
+                          hold_errors, key, request->method);
+}
+
+// Fetch url into the cache through the normal request path, as used by
+// background refreshes and admin prefetches. Errors are held back: a 5xx
+// must not replace a stale copy still within its stale-if-error window.
+int fetch_into_cache(const char *url, const char *method)
+{
+    char *raw = NULL;
+    if(asprintf(&raw, "%s %s HTTP/1.1\r\n\r\n", method, url) < 0) return PROXY_ERR;
     
-    // Cache response for GET requests
-    if(response_buffer && total_response_size > 0 && should_cache(request->method)) {
-        response_buffer[total_response_size] = '\0';
-        add_cache_element(response_buffer, total_response_size, original_request, request->method);
-        printf("Response cached successfully (%d bytes)\n", total_response_size);
+    ParsedRequest *request = ParsedRequest_create();
+    int result = PROXY_ERR;
+    if(request && ParsedRequest_parse(request, raw, strlen(raw)) == 0 && request->host && request->path) {
+        char *key = cache_key(request);
+        if(key) result = handle_request(-1, request, key, 1);
+        free(key);
     }
-    
-    if(response_buffer) free(response_buffer);
-    free(buf);
-    close(remoteSocketID);
-    return 0;
+    ParsedRequest_destroy(request);
+    free(raw);
+    return result;
 }
 
 int checkHTTPversion(char *msg)
@@ -286,51 +1184,169 @@ int is_supported_method(char* method) {
             strcmp(method, "POST") == 0 || 
             strcmp(method, "PUT") == 0 || 
             strcmp(method, "PATCH") == 0 || 
-            strcmp(method, "DELETE") == 0);
+            strcmp(method, "DELETE") == 0 ||
+            strcmp(method, "CONNECT") == 0);
+}
+
+// Open the upstream connection for a CONNECT request and hand both sockets
+// to the tunnel relay. raw holds the raw_len bytes received so far. Returns
+// 1 once the tunnel owns clientSocket, 0 if an error response was sent and
+// the caller still owns it.
+int handle_connect(int clientSocket, ParsedRequest *request, const char *raw, int raw_len)
+{
+    int server_port = 443;
+    if(request->port != NULL)
+        server_port = atoi(request->port);
+    
+    // Over the tunnel limit the client hears so before any 200
+    if(tunnel_reserve() < 0) {
+        sendErrorMessage(clientSocket, 503);
+        return 0;
+    }
+    
+    int remoteSocketID = connectRemoteServer(request->host, server_port);
+    if(remoteSocketID < 0)
+    {
+        tunnel_unreserve();
+        sendErrorMessage(clientSocket, remoteSocketID == PROXY_ERR_TIMEOUT ? 504 : 502);
+        return 0;
+    }
+    
+    const char *established = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    if(send(clientSocket, established, strlen(established), 0) < 0) {
+        perror("Error sending data to client");
+        tunnel_unreserve();
+        close(remoteSocketID);
+        return 0;
+    }
+    
+    // Anything the client pipelined after the CONNECT headers belongs
+    // upstream, byte for byte: a TLS ClientHello is full of NULs, so this
+    // comes from the raw buffer rather than the parsed body
+    const char *headers_end = strstr(raw, "\r\n\r\n");
+    const char *pipelined = headers_end ? headers_end + 4 : raw + raw_len;
+    int pipelined_len = raw + raw_len - pipelined;
+    if(pipelined_len > 0) {
+        if(send(remoteSocketID, pipelined, pipelined_len, 0) < 0) {
+            tunnel_unreserve();
+            close(remoteSocketID);
+            return 0;
+        }
+    }
+    
+    char target[MAX_HOSTNAME_LEN + MAX_PORT_LEN + 2];
+    snprintf(target, sizeof(target), "%s:%d", request->host, server_port);
+    if(tunnel_start(clientSocket, remoteSocketID, target) < 0) {
+        // Out of pipes after answering 200: all we can do is drop the connection
+        printf("Failed to start tunnel to %s\n", target);
+        close(remoteSocketID);
+        return 0;
+    }
+    
+    printf("Tunnel established to %s\n", target);
+    return 1;
+}
+
+void worker_slot_acquire()
+{
+    pthread_mutex_lock(&worker_lock);
+    while(active_workers >= config.max_clients) {
+        pthread_cond_wait(&worker_cond, &worker_lock);
+    }
+    active_workers++;
+    pthread_mutex_unlock(&worker_lock);
+}
+
+// Give back the worker slot and the client's admission; tracked_addr is 0
+// for a request admission_check() admitted untracked
+void worker_slot_release(uint32_t tracked_addr)
+{
+    pthread_mutex_lock(&worker_lock);
+    active_workers--;
+    pthread_cond_signal(&worker_cond);
+    pthread_mutex_unlock(&worker_lock);
+    if(tracked_addr) admission_release(tracked_addr);
+    __atomic_sub_fetch(&live_workers, 1, __ATOMIC_RELEASE);
+}
+
+// Answer a connection refused by admission control from the accept loop.
+// Whatever of the request already arrived is read first, so closing with
+// it unread does not reset the connection before the answer gets out.
+void refuse_connection(int socket, int status, int retry_after)
+{
+    char discard[4096];
+    while(recv(socket, discard, sizeof(discard), MSG_DONTWAIT) > 0) {}
+    sendErrorMessageRetryAfter(socket, status, retry_after);
+    close(socket);
 }
 
-void *thread_fn(void *socketNew){
-    sem_wait(&semaphore);
+void *thread_fn(void *connNew){
+    client_conn *conn = (client_conn*)connNew;
+    trace_record trace;
+    trace_begin(&trace, conn->accepted_ns);
+    
+    worker_slot_acquire();
+    trace_mark(TRACE_SLOT);
+    
+    int socket = conn->socket;
+    uint32_t client_addr = conn->admission_tracked ? conn->addr.sin_addr.s_addr : 0;
     
-    int *t = (int*)socketNew;
-    int socket = *t;
+    char str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &conn->addr.sin_addr, str, INET_ADDRSTRLEN);
+    printf("Client connected: %s:%d\n", str, ntohs(conn->addr.sin_port));
     
-    char *buffer = (char*)calloc(MAX_BYTES * 2, sizeof(char));
+    // Overloaded and this one waited too long: answer now, not late
+    if(admission_dequeue(trace_now_ns() - conn->accepted_ns)) {
+        printf("Shedding request from %s after waiting for a worker slot\n", str);
+        free(conn);
+        refuse_connection(socket, 503, 1);
+        trace_outcome(TRACE_ERROR, PROXY_ERR);
+        trace_end();
+        worker_slot_release(client_addr);
+        return NULL;
+    }
+    free(conn);
+    
+    // A stalled client must not hold a worker slot forever either
+    set_socket_timeouts(socket);
+    
+    int request_size = config.buffer_size * 2;
+    char *buffer = (char*)calloc(request_size, sizeof(char));
     if(!buffer) {
         printf("Memory allocation failed\n");
-        sem_post(&semaphore);
+        close(socket);
+        trace_end();
+        worker_slot_release(client_addr);
         return NULL;
     }
     
     // Receive request
-    int bytes_recv = recv(socket, buffer, MAX_BYTES * 2 - 1, 0);
+    int bytes_recv = recv(socket, buffer, request_size - 1, 0);
     if(bytes_recv <= 0) {
         printf("Failed to receive data from client\n");
         free(buffer);
         close(socket);
-        sem_post(&semaphore);
+        trace_outcome(TRACE_ERROR, PROXY_ERR);
+        trace_end();
+        worker_slot_release(client_addr);
         return NULL;
     }
 
-    // Ensure complete HTTP request
+    // Ensure complete HTTP request. Appends go by byte count: whatever a
+    // client sends after the headers (a CONNECT's ClientHello) may hold NULs.
     while(bytes_recv > 0 && !strstr(buffer, "\r\n\r\n")) {
-        int len = strlen(buffer);
-        if(len < MAX_BYTES * 2 - 1) {
-            int additional = recv(socket, buffer + len, MAX_BYTES * 2 - len - 1, 0);
+        if(bytes_recv < request_size - 1) {
+            int additional = recv(socket, buffer + bytes_recv, request_size - bytes_recv - 1, 0);
             if(additional <= 0) break;
             bytes_recv += additional;
+            buffer[bytes_recv] = '\0';
         } else {
             break;
         }
     }
     
     buffer[bytes_recv] = '\0';
-    
-    // Create copy for caching
-    char *tempReq = (char*)malloc((strlen(buffer) + 1) * sizeof(char));
-    if(tempReq) {
-        strcpy(tempReq, buffer);
-    }
+    trace_mark(TRACE_READ);
     
     // Parse request using our custom parser
     ParsedRequest* request = ParsedRequest_create();
@@ -338,16 +1354,19 @@ void *thread_fn(void *socketNew){
         printf("Failed to create ParsedRequest\n");
         sendErrorMessage(socket, 500);
         free(buffer);
-        if(tempReq) free(tempReq);
         close(socket);
-        sem_post(&semaphore);
+        trace_end();
+        worker_slot_release(client_addr);
         return NULL;
     }
     
     if(ParsedRequest_parse(request, buffer, strlen(buffer)) < 0) {
         printf("Failed to parse request\n");
         sendErrorMessage(socket, 400);
+        trace_outcome(TRACE_ERROR, PROXY_ERR);
     } else {
+        trace_mark(TRACE_PARSE);
+        trace_request(request->method, request->path ? request->path : "", request->version);
         printf("Method: %s, Host: %s, Path: %s, Content-Length: %d\n", 
                request->method, request->host ? request->host : "NULL", 
                request->path ? request->path : "NULL", request->content_length);
@@ -355,29 +1374,59 @@ void *thread_fn(void *socketNew){
         if(!is_supported_method(request->method)) {
             printf("Method %s not supported\n", request->method);
             sendErrorMessage(socket, 501);
+            trace_outcome(TRACE_ERROR, PROXY_ERR);
         } else if(!request->host || !request->path || 
                   checkHTTPversion(request->version) != 1) {
             printf("Invalid request format\n");
             sendErrorMessage(socket, 400);
+            trace_outcome(TRACE_ERROR, PROXY_ERR);
+        } else if(strcmp(request->method, "CONNECT") == 0) {
+            trace_outcome(TRACE_TUNNEL, 0);
+            if(handle_connect(socket, request, buffer, bytes_recv)) {
+                socket = -1;    // now owned by the tunnel relay
+            }
         } else {
-            // Check cache for GET requests only
-            if(should_cache(request->method) && tempReq) {
-                cache_element* cached = find(tempReq, request->method);
-                if(cached) {
-                    printf("Data retrieved from cache\n");
-                    send(socket, cached->data, cached->len, 0);
-                    free(buffer);
-                    if(tempReq) free(tempReq);
-                    ParsedRequest_destroy(request);
-                    close(socket);
-                    sem_post(&semaphore);
-                    return NULL;
+            // Check cache for cacheable methods only
+            char *key = cache_key(request);
+            cache_element* cached = NULL;
+            if(should_cache(request->method) && key) {
+                cached = find(key, request->method);
+            }
+            int state = cached ? cache_element_state(cached, time(NULL)) : CACHE_EXPIRED;
+            if(key) trace_request(request->method, key, request->version);
+            trace_mark(TRACE_LOOKUP);
+            
+            // Expired copies stay pinned: they stand in if the origin fails
+            int result = 0;
+            if(state == CACHE_FRESH) {
+                printf("Data retrieved from cache\n");
+            } else if(state == CACHE_STALE) {
+                printf("Serving stale copy, refreshing in background\n");
+                refresh_schedule(key, request->method);
+            } else {
+                int hold = cached && cache_element_usable_on_error(cached, time(NULL));
+                result = handle_request(socket, request, key, hold);
+                if(result < 0 && hold) {
+                    printf("Origin failed, serving stale copy\n");
+                    state = CACHE_STALE;
+                    result = 0;
                 }
             }
+            if(cached && state != CACHE_EXPIRED) {
+                trace_status(cached_status(cached));
+                send_cached(socket, cached);
+            }
+            cache_element_release(cached);
+            free(key);
+            
+            int outcome = state == CACHE_FRESH ? TRACE_HIT : state == CACHE_STALE ? TRACE_STALE : TRACE_MISS;
+            trace_outcome(result < 0 ? TRACE_ERROR : outcome, result);
             
-            // Handle the request
-            int result = handle_request(socket, request, tempReq ? tempReq : buffer);
-            if(result == -1) {
+            if(result == PROXY_ERR_TIMEOUT) {
+                sendErrorMessage(socket, 504);
+            } else if(result == PROXY_ERR_UNREACHABLE) {
+                sendErrorMessage(socket, 502);
+            } else if(result < 0) {
                 sendErrorMessage(socket, 500);
             }
         }
@@ -385,209 +1434,574 @@ void *thread_fn(void *socketNew){
     
     ParsedRequest_destroy(request);
     free(buffer);
-    if(tempReq) free(tempReq);
-    close(socket);
-    sem_post(&semaphore);
+    if(socket >= 0) close(socket);
+    trace_end();
+    capture_write(&trace);
+    worker_slot_release(client_addr);
     
     return NULL;
 }
 
-int main(int argc, char *argv[])
+// accept() on a listener gives up every LISTENER_WAKEUP_MS so the accept
+// loops notice a hot restart; listeners taken over get the same treatment
+#define LISTENER_WAKEUP_MS 500
+
+void listener_set_wakeup(int socketId)
 {
-    int client_socketId, client_len;
-    struct sockaddr_in server_addr, client_addr;
-    
-    sem_init(&semaphore, 0, MAX_CLIENTS);
-    pthread_mutex_init(&lock, NULL);
-    
-    if(argc == 2) {
-        port_number = atoi(argv[1]);
-    } else {
-        printf("Usage: %s <port_number>\n", argv[0]);
-        exit(1);
-    }
-    
-    printf("Starting Multi-Method Proxy Server at port: %d\n", port_number);
-    printf("Supported methods: GET, POST, PUT, PATCH, DELETE\n");
+    struct timeval tv = { 0, LISTENER_WAKEUP_MS * 1000 };
+    setsockopt(socketId, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+int create_listener(int reuseport)
+{
+    struct sockaddr_in server_addr;
     
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
-    if(proxy_socketId < 0) {
+    int socketId = socket(AF_INET, SOCK_STREAM, 0);
+    if(socketId < 0) {
         perror("Failed to create socket");
-        exit(1);
+        return -1;
     }
     
     int reuse = 1;
-    if(setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0) {
+    if(setsockopt(socketId, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0) {
         perror("setsockopt failed");
-        exit(1);
+        close(socketId);
+        return -1;
+    }
+    
+    if(reuseport && setsockopt(socketId, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("SO_REUSEPORT failed");
+        close(socketId);
+        return -1;
+    }
+    
+    // Only wake accept() once the client has actually sent its request
+    if(config.defer_accept_secs > 0 &&
+       setsockopt(socketId, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept_secs, sizeof(config.defer_accept_secs)) < 0) {
+        perror("TCP_DEFER_ACCEPT failed");
     }
     
     bzero((char*)&server_addr, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_number);
+    server_addr.sin_port = htons(config.port_number);
     server_addr.sin_addr.s_addr = INADDR_ANY;
     
-    if(bind(proxy_socketId, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    if(bind(socketId, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
-        exit(1);
+        close(socketId);
+        return -1;
     }
     
-    if(listen(proxy_socketId, MAX_CLIENTS) < 0) {
+    if(listen(socketId, config.max_clients) < 0) {
         perror("Listen failed");
-        exit(1);
+        close(socketId);
+        return -1;
+    }
+    
+    listener_set_wakeup(socketId);
+    return socketId;
+}
+
+// The CPUs this process may run on, in order. Under a cpuset or taskset
+// they need not be 0..n-1, and pinning to any other CPU fails.
+int allowed_cpus(int *out, int max)
+{
+    cpu_set_t set;
+    int count = 0;
+    
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+            if(CPU_ISSET(cpu, &set)) out[count++] = cpu;
+        }
+    }
+    if(count == 0) {
+        int online = sysconf(_SC_NPROCESSORS_ONLN);
+        for(int cpu = 0; cpu < online && count < max; cpu++) out[count++] = cpu;
+    }
+    if(count == 0) out[count++] = 0;
+    return count;
+}
+
+// Steer each new connection to the listener pinned to the CPU that
+// received it, so accept and request handling stay on that core. Listener
+// i runs on cpus[i]. When those are CPUs 0..count-1 the CPU number is the
+// index; otherwise the program maps each listed CPU to its index and
+// returns count for any other, which makes the kernel fall back to its hash.
+void attach_cpu_steering(int socketId, const int *cpus, int count)
+{
+    struct sock_filter code[2 + 2 * CPU_SETSIZE];
+    int n = 0, identity = 1;
+    
+    for(int i = 0; i < count; i++) identity &= cpus[i] == i;
+    
+    code[n++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+    if(identity) {
+        code[n++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };
+    } else {
+        for(int i = 0; i < count; i++) {
+            code[n++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (unsigned)cpus[i] };
+            code[n++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, (unsigned)i };
+        }
+        code[n++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, (unsigned)count };
+    }
+    struct sock_fprog prog = { n, code };
+    
+    if(setsockopt(socketId, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror("SO_ATTACH_REUSEPORT_CBPF failed, using kernel hash distribution");
     }
+}
+
+void spawn_worker(client_conn *conn, pthread_attr_t *attr)
+{
+    conn->accepted_ns = trace_now_ns();
     
-    printf("Proxy server listening on port %d...\n", port_number);
+    int retry_after;
+    int busy = __atomic_load_n(&active_workers, __ATOMIC_RELAXED) >=
+               __atomic_load_n(&config.max_clients, __ATOMIC_RELAXED);
+    int refused = admission_check(conn->addr.sin_addr.s_addr, busy, &retry_after,
+                                  &conn->admission_tracked);
+    if(refused) {
+        refuse_connection(conn->socket, refused, retry_after);
+        free(conn);
+        return;
+    }
     
-    int i = 0;
-    int Connected_socketId[MAX_CLIENTS];
+    pthread_t tid;
+    __atomic_add_fetch(&live_workers, 1, __ATOMIC_RELAXED);
+    if(pthread_create(&tid, attr, thread_fn, conn) != 0) {
+        printf("Failed to create worker thread\n");
+        __atomic_sub_fetch(&live_workers, 1, __ATOMIC_RELAXED);
+        if(conn->admission_tracked) admission_release(conn->addr.sin_addr.s_addr);
+        close(conn->socket);
+        free(conn);
+    }
+}
+
+// Multishot accept: one SQE keeps producing a completion per connection, and
+// a single io_uring_enter() reaps every connection that arrived meanwhile.
+// Returns 0 once draining, with the accept cancelled and every connection
+// it produced handed to a worker; -1 if the ring stops working, so the
+// caller can fall back.
+int accept_loop_uring(listener *l, pthread_attr_t *attr)
+{
+    uring ring;
+    if(uring_init(&ring, 64) < 0) return -1;
     
+    int multishot = 1, armed = 0, cancelled = 0;
     while(1) {
-        bzero((char*)&client_addr, sizeof(client_addr));
-        client_len = sizeof(client_addr);
+        int stop = __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+        if(stop && !armed) {
+            uring_destroy(&ring);
+            return 0;
+        }
+        if(stop && !cancelled) {
+            uring_prep_cancel(uring_get_sqe(&ring), 0, 1);
+            cancelled = 1;
+        }
+        if(!armed) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+            if(multishot) uring_prep_accept_multishot(sqe, l->socketId, 0);
+            else uring_prep_accept(sqe, l->socketId, 0);
+            armed = 1;
+        }
         
-        client_socketId = accept(proxy_socketId, (struct sockaddr*)&client_addr, (socklen_t*)&client_len);
+        if(uring_enter(&ring, 1, LISTENER_WAKEUP_MS) < 0) {
+            perror("io_uring_enter failed, falling back to accept()");
+            uring_destroy(&ring);
+            return -1;
+        }
         
-        if(client_socketId < 0) {
-            perror("Accept failed");
+        struct io_uring_cqe *cqe;
+        while((cqe = uring_peek_cqe(&ring)) != NULL) {
+            int res = cqe->res;
+            unsigned long long user_data = cqe->user_data;
+            int more = cqe->flags & IORING_CQE_F_MORE;
+            uring_cqe_seen(&ring);
+            
+            if(user_data != 0) continue;        // the cancel's own completion
+            if(!more) armed = 0;
+            if(res == -ECANCELED) continue;
+            
+            if(res == -EINVAL && multishot) {
+                printf("Multishot accept unsupported, re-arming per connection\n");
+                multishot = 0;
+                continue;
+            }
+            if(res < 0) {
+                fprintf(stderr, "Accept failed: %s\n", strerror(-res));
+                continue;
+            }
+            
+            client_conn *conn = (client_conn*)malloc(sizeof(client_conn));
+            if(!conn) {
+                close(res);
+                continue;
+            }
+            conn->socket = res;
+            socklen_t client_len = sizeof(conn->addr);
+            if(getpeername(res, (struct sockaddr*)&conn->addr, &client_len) < 0) {
+                memset(&conn->addr, 0, sizeof(conn->addr));
+            }
+            spawn_worker(conn, attr);
+        }
+    }
+}
+
+void *accept_loop(void *arg)
+{
+    listener *l = (listener*)arg;
+    pthread_attr_t attr;
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    if(l->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(l->cpu, &cpus);
+        // Workers follow the listener only if pinning it worked; otherwise
+        // every pthread_create() would fail the same way
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            printf("Failed to pin listener to CPU %d\n", l->cpu);
+        } else {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+    }
+    
+    int done = config.uring_mode && accept_loop_uring(l, &attr) == 0;
+    
+    while(!done && !__atomic_load_n(&draining, __ATOMIC_ACQUIRE)) {
+        client_conn *conn = (client_conn*)malloc(sizeof(client_conn));
+        if(!conn) {
+            sleep(1);
             continue;
         }
         
-        Connected_socketId[i] = client_socketId;
-        
-        struct sockaddr_in *client_pt = (struct sockaddr_in*)&client_addr;
-        struct in_addr ip_addr = client_pt->sin_addr;
-        char str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN);
-        printf("Client connected: %s:%d\n", str, ntohs(client_addr.sin_port));
-        
-        pthread_create(&tid[i], NULL, thread_fn, (void*)&Connected_socketId[i]);
+        socklen_t client_len = sizeof(conn->addr);
+        conn->socket = accept(l->socketId, (struct sockaddr*)&conn->addr, &client_len);
+        if(conn->socket < 0) {
+            // Timeouts are the periodic wakeup from listener_set_wakeup()
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("Accept failed");
+            free(conn);
+            continue;
+        }
         
-        i = (i + 1) % MAX_CLIENTS;
+        spawn_worker(conn, &attr);
     }
     
-    close(proxy_socketId);
-    return 0;
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+// Push reloadable settings out to the modules that cache them. Shrinking
+// the cache budget hands eviction to a background trimmer that works in
+// small batches, so readers never wait behind a full purge.
+int trim_running = 0;
+
+void *cache_trim_fn(void *arg)
+{
+    while(cache_trim(CACHE_EVICT_BATCH)) {
+        usleep(1000);
+    }
+    cache_stats stats;
+    cache_get_stats(&stats);
+    printf("Cache trimmed to budget (%ld bytes in use)\n", stats.bytes);
+    __atomic_store_n(&trim_running, 0, __ATOMIC_RELEASE);
+    return NULL;
 }
 
-// Cache functions
-cache_element* find(char* url, char* method){
-    cache_element* site = NULL;
+void apply_config(proxy_config *next)
+{
+    if(next->port_number != config.port_number || next->reuseport_mode != config.reuseport_mode ||
+       next->defer_accept_secs != config.defer_accept_secs || next->uring_mode != config.uring_mode ||
+       next->refresh_workers != config.refresh_workers || next->admin_port != config.admin_port ||
+       strcmp(next->upgrade_socket, config.upgrade_socket) != 0 ||
+       next->upgrade_cache_bytes != config.upgrade_cache_bytes) {
+        printf("Listener, io_uring, refresh worker, admin and upgrade settings only take effect on restart\n");
+    }
+    if(next->response_window < next->buffer_size) next->response_window = next->buffer_size;
     
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    if(temp_lock_val != 0) {
-        printf("Cache lock failed: %d\n", temp_lock_val);
-        return NULL;
+    __atomic_store_n(&config.cache_max_bytes, next->cache_max_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.cache_max_element_bytes, next->cache_max_element_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.max_tunnels, next->max_tunnels, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.buffer_size, next->buffer_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.response_window, next->response_window, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.connect_timeout_ms, next->connect_timeout_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.read_timeout_ms, next->read_timeout_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.write_timeout_ms, next->write_timeout_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.tunnel_idle_timeout, next->tunnel_idle_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.cacheable_methods, next->cacheable_methods, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.default_ttl, next->default_ttl, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.stale_while_revalidate, next->stale_while_revalidate, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.stale_if_error, next->stale_if_error, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.connect_failure_ttl, next->connect_failure_ttl, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.error_ttl_404, next->error_ttl_404, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.error_ttl_5xx, next->error_ttl_5xx, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.drain_timeout, next->drain_timeout, __ATOMIC_RELAXED);
+    
+    tunnel_set_limits(next->max_tunnels, next->tunnel_idle_timeout);
+    if(trace_configure(next->slow_request_ms, next->slow_log, next->trace_file, next->trace_sample) == 0) {
+        config.slow_request_ms = next->slow_request_ms;
+        config.trace_sample = next->trace_sample;
+        memcpy(config.slow_log, next->slow_log, sizeof(config.slow_log));
+        memcpy(config.trace_file, next->trace_file, sizeof(config.trace_file));
+    }
+    if(capture_configure(next->capture_file, next->capture_salt) == 0) {
+        memcpy(config.capture_file, next->capture_file, sizeof(config.capture_file));
+        memcpy(config.capture_salt, next->capture_salt, sizeof(config.capture_salt));
+    }
+    admission_configure(next->client_rate, next->client_burst, next->client_max_active,
+                        next->queue_target_ms, next->queue_interval_ms);
+    config.client_rate = next->client_rate;
+    config.client_burst = next->client_burst;
+    config.client_max_active = next->client_max_active;
+    config.queue_target_ms = next->queue_target_ms;
+    config.queue_interval_ms = next->queue_interval_ms;
+    if(peer_configure(next->peers, next->peer_self) == 0) {
+        memcpy(config.peers, next->peers, sizeof(config.peers));
+        memcpy(config.peer_self, next->peer_self, sizeof(config.peer_self));
     }
     
-    if(head != NULL) {
-        site = head;
-        while(site != NULL) {
-            if(!strcmp(site->url, url) && !strcmp(site->method, method)) {
-                printf("URL found in cache for method %s\n", method);
-                site->lru_time_track = time(NULL);
-                break;
-            }
-            site = site->next;
+    // Raising the worker cap admits threads already waiting for a slot
+    pthread_mutex_lock(&worker_lock);
+    config.max_clients = next->max_clients;
+    pthread_cond_broadcast(&worker_cond);
+    pthread_mutex_unlock(&worker_lock);
+    
+    cache_stats stats;
+    cache_set_limits(next->cache_max_bytes, next->cache_max_element_bytes);
+    cache_get_stats(&stats);
+    if(stats.bytes > next->cache_max_bytes &&
+       !__atomic_exchange_n(&trim_running, 1, __ATOMIC_ACQ_REL)) {
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, cache_trim_fn, NULL) == 0) {
+            pthread_detach(tid);
+        } else {
+            __atomic_store_n(&trim_running, 0, __ATOMIC_RELEASE);
         }
     }
-    
-    pthread_mutex_unlock(&lock);
-    return site;
 }
 
-void remove_cache_element(){
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    if(temp_lock_val != 0) {
-        printf("Remove cache lock failed: %d\n", temp_lock_val);
-        return;
-    }
+// Signals are blocked in every thread and handled synchronously here, so
+// a reload runs in normal thread context and can take locks
+void *signal_thread(void *arg)
+{
+    sigset_t *signals = (sigset_t*)arg;
+    int sig;
     
-    if(head != NULL) {
-        cache_element *p = head;
-        cache_element *q = head; 
-        cache_element *temp = head;
+    while(sigwait(signals, &sig) == 0) {
+        if(sig != SIGHUP) continue;
         
-        // Find element with oldest LRU timestamp
-        for(q = head; q->next != NULL; q = q->next) {
-            if((q->next)->lru_time_track < temp->lru_time_track) {
-                temp = q->next;
-                p = q;
-            }
+        if(!config_path) {
+            printf("SIGHUP ignored: no config file given (-f)\n");
+            continue;
         }
-        
-        if(temp == head) {
-            head = head->next;
-        } else {
-            p->next = temp->next;
+        proxy_config next = config;
+        if(config_load(config_path, &next) < 0) {
+            printf("Config reload failed, keeping current settings\n");
+            continue;
         }
-        
-        cache_size = cache_size - temp->len - sizeof(cache_element) - 
-                     strlen(temp->url) - strlen(temp->method) - 2;
-        
-        free(temp->data);
-        free(temp->url);
-        free(temp->method);
-        free(temp);
-        
-        printf("Cache element removed\n");
+        apply_config(&next);
+        printf("Configuration reloaded from %s\n", config_path);
+    }
+    return NULL;
+}
+
+// Hot restart, old side: a new process is accepting on our listeners.
+// The accept loops wind down on their next wakeup, and main() drains.
+void start_draining(void)
+{
+    printf("Handed over to the new process, draining\n");
+    __atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+    admin_stop();
+}
+
+// Let requests in flight and open tunnels finish, up to drain_timeout
+void drain_and_exit(void)
+{
+    time_t deadline = time(NULL) + __atomic_load_n(&config.drain_timeout, __ATOMIC_RELAXED);
+    tunnel_stats tunnels;
+    int workers;
+    
+    for(;;) {
+        workers = __atomic_load_n(&live_workers, __ATOMIC_ACQUIRE);
+        tunnel_get_stats(&tunnels);
+        if((workers == 0 && tunnels.active == 0) || time(NULL) >= deadline) break;
+        usleep(100000);
     }
     
-    pthread_mutex_unlock(&lock);
+    if(workers || tunnels.active) {
+        printf("Drain timeout: dropping %d requests and %ld tunnels\n", workers, tunnels.active);
+    } else {
+        printf("Drained, exiting\n");
+    }
+    exit(0);
 }
 
-int add_cache_element(char* data, int size, char* url, char* method){
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    if(temp_lock_val != 0) {
-        printf("Add cache lock failed: %d\n", temp_lock_val);
-        return 0;
+void usage(char *prog)
+{
+    printf("Usage: %s [-f config_file] [-r] [-u] [-d defer_accept_secs] [-c connect_ms] "
+           "[-R read_ms] [-W write_ms] [-w window_bytes] [-a admin_port] "
+           "[-P peer_list -S self] [-U] <port_number>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, takeover = 0;
+    const char *options = "f:rud:c:R:W:w:a:P:S:U";
+    
+    config_defaults(&config);
+    
+    // Config file first so command-line options override it
+    while((opt = getopt(argc, argv, options)) != -1) {
+        if(opt == 'f') config_path = optarg;
+        else if(opt == '?') usage(argv[0]);
+    }
+    if(config_path && config_load(config_path, &config) < 0) {
+        exit(1);
+    }
+    
+    optind = 1;
+    while((opt = getopt(argc, argv, options)) != -1) {
+        switch(opt) {
+            case 'r': config.reuseport_mode = 1; break;
+            case 'u': config.uring_mode = 1; break;
+            case 'd': config.defer_accept_secs = atoi(optarg); break;
+            case 'c': config.connect_timeout_ms = atoi(optarg); break;
+            case 'R': config.read_timeout_ms = atoi(optarg); break;
+            case 'W': config.write_timeout_ms = atoi(optarg); break;
+            case 'w': config.response_window = atoi(optarg); break;
+            case 'a': config.admin_port = atoi(optarg); break;
+            case 'P': snprintf(config.peers, sizeof(config.peers), "%s", optarg); break;
+            case 'S': snprintf(config.peer_self, sizeof(config.peer_self), "%s", optarg); break;
+            case 'U': takeover = 1; break;
+        }
     }
     
-    int element_size = size + 1 + strlen(url) + strlen(method) + 2 + sizeof(cache_element);
+    if(optind == argc - 1) {
+        config.port_number = atoi(argv[optind]);
+    } else if(optind != argc || !config_path) {
+        usage(argv[0]);
+    }
     
-    if(element_size > MAX_ELEMENT_SIZE) {
-        printf("Element too large for cache\n");
-        pthread_mutex_unlock(&lock);
-        return 0;
+    if(config.response_window < config.buffer_size) config.response_window = config.buffer_size;
+    cache_set_limits(config.cache_max_bytes, config.cache_max_element_bytes);
+    tunnel_set_limits(config.max_tunnels, config.tunnel_idle_timeout);
+    if(peer_configure(config.peers, config.peer_self) < 0) exit(1);
+    if(trace_configure(config.slow_request_ms, config.slow_log, config.trace_file, config.trace_sample) < 0) exit(1);
+    if(capture_configure(config.capture_file, config.capture_salt) < 0) exit(1);
+    admission_configure(config.client_rate, config.client_burst, config.client_max_active,
+                        config.queue_target_ms, config.queue_interval_ms);
+    
+    // Block SIGHUP before any thread exists; signal_thread picks it up
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t signal_tid;
+    if(pthread_create(&signal_tid, NULL, signal_thread, &signals) != 0) {
+        printf("Failed to start signal thread\n");
+        exit(1);
     }
+    pthread_detach(signal_tid);
+    
+    printf("Starting Multi-Method Proxy Server at port: %d\n", config.port_number);
+    printf("Supported methods: GET, POST, PUT, PATCH, DELETE, CONNECT\n");
+    
+    // A peer closing mid-send must not kill the whole proxy
+    signal(SIGPIPE, SIG_IGN);
     
-    // Make space if needed
-    while(cache_size + element_size > MAX_SIZE) {
-        remove_cache_element();
+    static int cpus[CPU_SETSIZE];
+    int cpu_count = allowed_cpus(cpus, CPU_SETSIZE);
+    
+    if(tunnel_init(cpu_count) < 0) {
+        printf("Failed to start tunnel relay\n");
+        exit(1);
+    }
+    if(refresh_init(config.refresh_workers, fetch_into_cache) < 0) {
+        printf("Failed to start refresh workers\n");
+        exit(1);
+    }
+    // Taking over: the listeners (and the admin API) come from the running
+    // proxy instead of bind(), along with its hottest cache entries
+    upgrade_sockets inherited;
+    inherited.listener_count = 0;
+    inherited.admin = -1;
+    if(takeover && upgrade_takeover(config.upgrade_socket, &inherited, config.upgrade_cache_bytes) < 0) {
+        exit(1);
     }
     
-    cache_element* element = (cache_element*)malloc(sizeof(cache_element));
-    if(!element) {
-        pthread_mutex_unlock(&lock);
-        return 0;
+    if((config.admin_port || inherited.admin >= 0) &&
+       admin_init(config.admin_port, inherited.admin, fetch_into_cache) < 0) {
+        exit(1);
     }
     
-    element->data = (char*)malloc(size + 1);
-    element->url = (char*)malloc(strlen(url) + 1);
-    element->method = (char*)malloc(strlen(method) + 1);
+    if(config.uring_mode && !uring_supported()) {
+        printf("io_uring unavailable, falling back to accept()/poll()\n");
+        config.uring_mode = 0;
+    } else if(config.uring_mode) {
+        printf("Using io_uring for accept and response relay\n");
+    }
     
-    if(!element->data || !element->url || !element->method) {
-        if(element->data) free(element->data);
-        if(element->url) free(element->url);
-        if(element->method) free(element->method);
-        free(element);
-        pthread_mutex_unlock(&lock);
-        return 0;
+    // One listener per allowed core, created in CPU order so the steering
+    // program can map each CPU to its socket index in the reuseport group.
+    // Taken-over listeners keep the old process's layout and steering.
+    int listener_count = takeover ? inherited.listener_count : config.reuseport_mode ? cpu_count : 1;
+    int pin_cpus = takeover ? listener_count > 1 && listener_count <= cpu_count : config.reuseport_mode;
+    listener *listeners = (listener*)calloc(listener_count, sizeof(listener));
+    if(!listeners) exit(1);
+    
+    for(int i = 0; i < listener_count; i++) {
+        listeners[i].cpu = pin_cpus ? cpus[i] : -1;
+        if(takeover) {
+            listeners[i].socketId = inherited.listeners[i];
+            listener_set_wakeup(listeners[i].socketId);
+        } else {
+            listeners[i].socketId = create_listener(config.reuseport_mode);
+        }
+        if(listeners[i].socketId < 0) exit(1);
+    }
+    proxy_socketId = listeners[0].socketId;
+    if(config.reuseport_mode && !takeover) attach_cpu_steering(proxy_socketId, cpus, cpu_count);
+    
+    for(int i = 0; i < listener_count; i++) {
+        if(pthread_create(&listeners[i].thread, NULL, accept_loop, &listeners[i]) != 0) {
+            printf("Failed to start listener %d\n", i);
+            exit(1);
+        }
     }
     
-    memcpy(element->data, data, size);
-    element->data[size] = '\0';
-    strcpy(element->url, url);
-    strcpy(element->method, method);
-    element->lru_time_track = time(NULL);
-    element->len = size;
-    element->next = head;
+    if(listener_count > 1) {
+        printf("Proxy server listening on port %d with %d SO_REUSEPORT listeners...\n",
+               config.port_number, listener_count);
+    } else {
+        printf("Proxy server listening on port %d...\n", config.port_number);
+    }
     
-    head = element;
-    cache_size += element_size;
+    // Accepting now: the old process may stop, and this one can be replaced
+    if(takeover) upgrade_ready();
+    // Handing over only some listeners would drop whatever the rest had
+    // queued when this process exits, so that is not offered at all
+    if(config.upgrade_socket[0] && listener_count > UPGRADE_MAX_LISTENERS) {
+        printf("Hot restart disabled: %d listeners, at most %d can be handed over\n",
+               listener_count, UPGRADE_MAX_LISTENERS);
+    } else if(config.upgrade_socket[0]) {
+        upgrade_sockets own;
+        own.listener_count = listener_count;
+        for(int i = 0; i < own.listener_count; i++) own.listeners[i] = listeners[i].socketId;
+        own.admin = admin_listener();
+        upgrade_serve(config.upgrade_socket, &own, start_draining);
+    }
     
-    printf("Added to cache: %s %s (%d bytes)\n", method, url, size);
+    for(int i = 0; i < listener_count; i++) {
+        pthread_join(listeners[i].thread, NULL);
+    }
     
-    pthread_mutex_unlock(&lock);
-    return 1;
-}
\ No newline at end of file
+    for(int i = 0; i < listener_count; i++) {
+        close(listeners[i].socketId);
+    }
+    free(listeners);
+    drain_and_exit();
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "proxy_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+const char *trace_phase_names[TRACE_PHASES] = {
+    "slot", "read", "parse", "lookup", "dns", "connect", "ttfb", "send"
+};
+
+const char *trace_outcome_names[TRACE_OUTCOMES] = { "miss", "hit", "stale", "tunnel", "error" };
+
+static __thread trace_record *trace_current;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int slow_us;                 // 0 = slow log off
+static int sample_every;            // 0 = binary trace off
+static unsigned long sample_count;
+static FILE *slow_fp;               // NULL = stdout
+static FILE *trace_fp;
+static char slow_path[1024];
+static char trace_path[1024];
+
+uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Open path for appending unless it is already the open one
+static int trace_reopen(FILE **fp, char *current, size_t current_len, const char *path, int binary) {
+    if(!strcmp(current, path)) return 0;
+    
+    FILE *next = NULL;
+    if(path[0]) {
+        next = fopen(path, binary ? "ab" : "a");
+        if(!next) {
+            perror(path);
+            return -1;
+        }
+        if(!binary) setvbuf(next, NULL, _IOLBF, 0);
+    }
+    
+    if(binary && next && ftell(next) == 0) {
+        trace_file_header header = { TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record), TRACE_PHASES };
+        fwrite(&header, sizeof(header), 1, next);
+        fflush(next);
+    }
+    
+    if(*fp) fclose(*fp);
+    *fp = next;
+    snprintf(current, current_len, "%s", path);
+    return 0;
+}
+
+int trace_configure(int slow_request_ms, const char *slow_log, const char *trace_file, int sample) {
+    pthread_mutex_lock(&trace_lock);
+    int ret = trace_reopen(&slow_fp, slow_path, sizeof(slow_path), slow_log, 0);
+    if(trace_reopen(&trace_fp, trace_path, sizeof(trace_path), trace_file, 1) < 0) ret = -1;
+    slow_us = slow_request_ms > 0 ? slow_request_ms * 1000 : 0;
+    sample_every = trace_fp ? sample : 0;
+    pthread_mutex_unlock(&trace_lock);
+    return ret;
+}
+
+void trace_begin(trace_record *trace, uint64_t start_ns) {
+    memset(trace, 0, sizeof(*trace));
+    trace->start_ns = start_ns;
+    
+    // Wall-clock time of the same instant
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    trace->wall_us = now_us - (trace_now_ns() - start_ns) / 1000;
+    
+    trace_current = trace;
+}
+
+void trace_mark(int phase) {
+    trace_record *trace = trace_current;
+    if(!trace) return;
+    
+    // 0 means "not reached", so a phase ending within the first
+    // microsecond is recorded as 1
+    uint64_t us = (trace_now_ns() - trace->start_ns) / 1000;
+    trace->mark_us[phase] = us > 0 ? (uint32_t)us : 1;
+}
+
+void trace_request(const char *method, const char *url, const char *version) {
+    trace_record *trace = trace_current;
+    if(!trace) return;
+    snprintf(trace->method, sizeof(trace->method), "%s", method);
+    snprintf(trace->version, sizeof(trace->version), "%s", version ? version : "");
+    snprintf(trace->url, sizeof(trace->url), "%s", url);
+    
+    trace->url_hash = 14695981039346656037ULL;
+    for(const char *c = url; *c; c++) trace->url_hash = (trace->url_hash ^ (unsigned char)*c) * 1099511628211ULL;
+}
+
+void trace_outcome(int outcome, int result) {
+    if(!trace_current) return;
+    trace_current->outcome = outcome;
+    trace_current->result = result;
+}
+
+void trace_status(int status) {
+    if(trace_current) trace_current->status = status;
+}
+
+void trace_add_bytes(uint64_t bytes) {
+    if(trace_current) trace_current->bytes += bytes;
+}
+
+uint32_t trace_phase_us(const trace_record *trace, int phase) {
+    if(!trace->mark_us[phase]) return 0;
+    
+    uint32_t prev = 0;
+    for(int i = 0; i < phase; i++) {
+        if(trace->mark_us[i] > prev) prev = trace->mark_us[i];
+    }
+    return trace->mark_us[phase] > prev ? trace->mark_us[phase] - prev : 0;
+}
+
+static void trace_log_slow(trace_record *trace) {
+    char when[32];
+    time_t secs = trace->wall_us / 1000000;
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime_r(&secs, &tm));
+    
+    FILE *out = slow_fp ? slow_fp : stdout;
+    fprintf(out, "%s.%03d slow %.1fms %s %s %s status=%d result=%d bytes=%llu",
+            when, (int)(trace->wall_us / 1000 % 1000), trace->mark_us[TRACE_DONE] / 1000.0,
+            trace_outcome_names[trace->outcome], trace->method[0] ? trace->method : "-",
+            trace->url[0] ? trace->url : "-", trace->status, trace->result,
+            (unsigned long long)trace->bytes);
+    for(int i = 0; i < TRACE_PHASES; i++) {
+        if(trace->mark_us[i]) fprintf(out, " %s=%.1f", trace_phase_names[i], trace_phase_us(trace, i) / 1000.0);
+    }
+    fprintf(out, "\n");
+}
+
+void trace_end() {
+    trace_record *trace = trace_current;
+    if(!trace) return;
+    trace_mark(TRACE_DONE);
+    trace_current = NULL;
+    
+    pthread_mutex_lock(&trace_lock);
+    if(slow_us && trace->mark_us[TRACE_DONE] >= (uint32_t)slow_us) {
+        trace_log_slow(trace);
+    }
+    if(sample_every && ++sample_count % sample_every == 0) {
+        // Sampled, so a flush per record is cheap and a crash loses nothing
+        fwrite(trace, sizeof(*trace), 1, trace_fp);
+        fflush(trace_fp);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,77 @@
+#ifndef PROXY_TRACE_H
+#define PROXY_TRACE_H
+
+// Per-request phase tracing. Each worker keeps one trace_record, stamped
+// with CLOCK_MONOTONIC at the end of every phase it passes through. When
+// the request ends the record is written in full to the slow-request log
+// if it took longer than slow_request_ms, and 1 in trace_sample records are
+// appended to a binary trace file (see tools/trace_summary).
+//
+// The record being filled is per-thread, so code deep in the request path
+// (DNS, connect, relay) can mark phases without it being passed down.
+
+#include <stdint.h>
+
+enum {
+    TRACE_SLOT,                     // accepted -> worker slot acquired
+    TRACE_READ,                     // request headers read
+    TRACE_PARSE,
+    TRACE_LOOKUP,                   // cache lookup
+    TRACE_DNS,                      // getaddrinfo() returned
+    TRACE_CONNECT,                  // upstream (origin or peer) connected
+    TRACE_FIRST_BYTE,               // first upstream response byte
+    TRACE_DONE,                     // last byte sent to the client
+    TRACE_PHASES
+};
+
+// How the request was answered
+enum { TRACE_MISS, TRACE_HIT, TRACE_STALE, TRACE_TUNNEL, TRACE_ERROR, TRACE_OUTCOMES };
+
+#define TRACE_MAGIC 0x43525450      // "PTRC" little-endian
+#define TRACE_VERSION 2
+#define TRACE_URL_LEN 160
+
+// Binary trace file: one trace_file_header, then fixed-size records
+typedef struct trace_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t phases;
+} trace_file_header;
+
+typedef struct trace_record {
+    uint64_t start_ns;              // CLOCK_MONOTONIC at accept
+    uint64_t wall_us;               // CLOCK_REALTIME at accept, for humans
+    uint32_t mark_us[TRACE_PHASES]; // microseconds since start; 0 = phase not reached
+    int32_t result;                 // 0 or a PROXY_ERR_* code
+    uint32_t outcome;               // TRACE_MISS etc.
+    int32_t status;                 // HTTP status sent to the client, 0 = unknown
+    uint32_t reserved;
+    uint64_t bytes;                 // response bytes sent to the client
+    uint64_t url_hash;              // FNV-1a of the full cache key
+    char method[16];
+    char version[16];
+    char url[TRACE_URL_LEN];        // truncated cache key
+} trace_record;
+
+extern const char *trace_phase_names[TRACE_PHASES];
+extern const char *trace_outcome_names[TRACE_OUTCOMES];
+
+uint64_t trace_now_ns();
+
+// Reloadable; slow_log / trace_file empty = stdout / off. Files are
+// reopened only when their path changes.
+int trace_configure(int slow_request_ms, const char *slow_log, const char *trace_file, int sample);
+
+void trace_begin(trace_record *trace, uint64_t start_ns);
+void trace_mark(int phase);
+void trace_request(const char *method, const char *url, const char *version);
+void trace_outcome(int outcome, int result);
+void trace_status(int status);
+void trace_add_bytes(uint64_t bytes);
+void trace_end();
+
+// Time spent in phase, given the marks reached before it; 0 if not reached
+uint32_t trace_phase_us(const trace_record *trace, int phase);
+
+#endif // PROXY_TRACE_H
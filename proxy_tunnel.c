@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include "proxy_tunnel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define TUNNEL_PIPE_SIZE (64*1024)
+#define TUNNEL_MAX_EVENTS 256
+#define TUNNEL_TARGET_LEN 272
+#define TUNNEL_PUMP_ROUNDS 16       // bound work per wakeup so one fast tunnel can't starve the rest
+
+typedef struct tunnel tunnel;
+
+// One direction of a tunnel: src socket -> pipe -> dst socket
+typedef struct tunnel_dir {
+    int src;
+    int dst;
+    int pipe_r;
+    int pipe_w;
+    size_t pending;                 // bytes sitting in the pipe
+    int src_eof;
+    int shut;                       // dst write side shut down after EOF drained
+    long long bytes;
+} tunnel_dir;
+
+// epoll registration for one socket of the pair
+typedef struct tunnel_end {
+    tunnel *t;
+    int fd;
+    uint32_t events;                // 0 = not in the epoll set
+} tunnel_end;
+
+struct tunnel {
+    tunnel_dir up;                  // client -> origin
+    tunnel_dir down;                // origin -> client
+    tunnel_end client;
+    tunnel_end remote;
+    time_t started;
+    time_t last_active;
+    int closed;
+    char target[TUNNEL_TARGET_LEN];
+    tunnel *prev;
+    tunnel *next;
+};
+
+typedef struct relay {
+    pthread_t thread;
+    int epfd;
+    int wakefd;
+    pthread_mutex_t lock;
+    tunnel *pending;                // handed over by workers, linked through next
+    tunnel *list;                   // owned by the relay thread
+    tunnel *dead;                   // closed this epoll batch, freed after it
+} relay;
+
+static relay *relays;
+static int relay_count;
+static unsigned int next_relay;
+static tunnel_stats stats;
+static int tunnel_max = MAX_TUNNELS;
+static int tunnel_idle_timeout = TUNNEL_IDLE_TIMEOUT;
+
+static void dir_init(tunnel_dir *d, int src, int dst, int pipefd[2]) {
+    d->src = src;
+    d->dst = dst;
+    d->pipe_r = pipefd[0];
+    d->pipe_w = pipefd[1];
+    d->pending = 0;
+    d->src_eof = 0;
+    d->shut = 0;
+    d->bytes = 0;
+}
+
+// Move as much as possible without blocking; returns -1 on a socket error
+static int dir_pump(tunnel_dir *d, long long *total, int *active) {
+    for(int round = 0; round < TUNNEL_PUMP_ROUNDS; round++) {
+        int progress = 0;
+        
+        if(d->pending > 0) {
+            ssize_t n = splice(d->pipe_r, NULL, d->dst, NULL, d->pending,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n > 0) {
+                d->pending -= n;
+                d->bytes += n;
+                __atomic_add_fetch(total, n, __ATOMIC_RELAXED);
+                progress = 1;
+            } else if(n < 0 && errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+        
+        if(!d->src_eof && d->pending < TUNNEL_PIPE_SIZE) {
+            ssize_t n = splice(d->src, NULL, d->pipe_w, NULL, TUNNEL_PIPE_SIZE - d->pending,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(n > 0) {
+                d->pending += n;
+                progress = 1;
+            } else if(n == 0) {
+                d->src_eof = 1;
+                progress = 1;
+            } else if(errno != EAGAIN && errno != EINTR) {
+                return -1;
+            }
+        }
+        
+        if(progress) *active = 1;
+        else break;
+    }
+    
+    if(d->src_eof && d->pending == 0 && !d->shut) {
+        shutdown(d->dst, SHUT_WR);
+        d->shut = 1;
+    }
+    return 0;
+}
+
+static void end_update(relay *r, tunnel_end *end, tunnel_dir *reading, tunnel_dir *writing) {
+    uint32_t events = 0;
+    if(!reading->src_eof && reading->pending < TUNNEL_PIPE_SIZE) events |= EPOLLIN;
+    if(writing->pending > 0) events |= EPOLLOUT;
+    
+    if(events == end->events) return;
+    
+    // epoll reports HUP/ERR even with no events requested, so a parked end
+    // is taken out of the set rather than left to wake the relay
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = end;
+    int op = events == 0 ? EPOLL_CTL_DEL : end->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    epoll_ctl(r->epfd, op, end->fd, &ev);
+    end->events = events;
+}
+
+static void tunnel_close(relay *r, tunnel *t, const char *reason) {
+    if(t->client.events) epoll_ctl(r->epfd, EPOLL_CTL_DEL, t->client.fd, NULL);
+    if(t->remote.events) epoll_ctl(r->epfd, EPOLL_CTL_DEL, t->remote.fd, NULL);
+    
+    if(t->prev) t->prev->next = t->next;
+    else r->list = t->next;
+    if(t->next) t->next->prev = t->prev;
+    
+    printf("Tunnel to %s closed (%s): %lld bytes up, %lld bytes down, %lds\n",
+           t->target, reason, t->up.bytes, t->down.bytes, (long)(time(NULL) - t->started));
+    
+    close(t->client.fd);
+    close(t->remote.fd);
+    close(t->up.pipe_r);
+    close(t->up.pipe_w);
+    close(t->down.pipe_r);
+    close(t->down.pipe_w);
+    
+    // Other events in the current batch may still point at this tunnel
+    t->closed = 1;
+    t->next = r->dead;
+    r->dead = t;
+    __atomic_sub_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+}
+
+static void tunnel_service(relay *r, tunnel *t) {
+    int active = 0;
+    if(dir_pump(&t->up, &stats.bytes_up, &active) < 0 ||
+       dir_pump(&t->down, &stats.bytes_down, &active) < 0) {
+        tunnel_close(r, t, "connection error");
+        return;
+    }
+    if(active) t->last_active = time(NULL);
+    
+    if(t->up.shut && t->down.shut) {
+        tunnel_close(r, t, "finished");
+        return;
+    }
+    end_update(r, &t->client, &t->up, &t->down);
+    end_update(r, &t->remote, &t->down, &t->up);
+}
+
+static void relay_adopt_pending(relay *r) {
+    uint64_t value;
+    if(read(r->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        perror("Tunnel relay wakeup failed");
+    }
+    
+    pthread_mutex_lock(&r->lock);
+    tunnel *t = r->pending;
+    r->pending = NULL;
+    pthread_mutex_unlock(&r->lock);
+    
+    while(t) {
+        tunnel *next = t->next;
+        
+        t->prev = NULL;
+        t->next = r->list;
+        if(r->list) r->list->prev = t;
+        r->list = t;
+        
+        // Both ends join the epoll set through end_update()
+        tunnel_service(r, t);
+        t = next;
+    }
+}
+
+static void relay_reap_idle(relay *r, time_t now) {
+    tunnel *t = r->list;
+    while(t) {
+        tunnel *next = t->next;
+        if(now - t->last_active > __atomic_load_n(&tunnel_idle_timeout, __ATOMIC_RELAXED)) {
+            tunnel_close(r, t, "idle timeout");
+        }
+        t = next;
+    }
+}
+
+static void *relay_fn(void *arg) {
+    relay *r = (relay*)arg;
+    struct epoll_event events[TUNNEL_MAX_EVENTS];
+    time_t last_scan = time(NULL);
+    
+    while(1) {
+        int n = epoll_wait(r->epfd, events, TUNNEL_MAX_EVENTS, 1000);
+        if(n < 0 && errno != EINTR) {
+            perror("Tunnel epoll_wait failed");
+            continue;
+        }
+        
+        for(int i = 0; i < n; i++) {
+            if(events[i].data.ptr == NULL) {
+                relay_adopt_pending(r);
+                continue;
+            }
+            tunnel *t = ((tunnel_end*)events[i].data.ptr)->t;
+            if(!t->closed) tunnel_service(r, t);
+        }
+        
+        time_t now = time(NULL);
+        if(now != last_scan) {
+            relay_reap_idle(r, now);
+            last_scan = now;
+        }
+        
+        while(r->dead) {
+            tunnel *t = r->dead;
+            r->dead = t->next;
+            free(t);
+        }
+    }
+    return NULL;
+}
+
+int tunnel_init(int relay_threads) {
+    if(relay_threads < 1) relay_threads = 1;
+    
+    relays = (relay*)calloc(relay_threads, sizeof(relay));
+    if(!relays) return -1;
+    
+    for(int i = 0; i < relay_threads; i++) {
+        relay *r = &relays[i];
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        r->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(r->epfd < 0 || r->wakefd < 0) {
+            perror("Failed to create tunnel relay");
+            return -1;
+        }
+        pthread_mutex_init(&r->lock, NULL);
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev);
+        
+        if(pthread_create(&r->thread, NULL, relay_fn, r) != 0) {
+            perror("Failed to start tunnel relay thread");
+            return -1;
+        }
+        pthread_detach(r->thread);
+        relay_count++;
+    }
+    return 0;
+}
+
+int tunnel_reserve(void) {
+    if(relay_count == 0) return -1;
+    
+    int limit = __atomic_load_n(&tunnel_max, __ATOMIC_RELAXED);
+    if(__atomic_add_fetch(&stats.active, 1, __ATOMIC_RELAXED) > limit) {
+        __atomic_sub_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+        printf("Tunnel limit reached (%d)\n", limit);
+        return -1;
+    }
+    return 0;
+}
+
+void tunnel_unreserve(void) {
+    __atomic_sub_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+}
+
+int tunnel_start(int client_fd, int remote_fd, const char *target) {
+    tunnel *t = (tunnel*)calloc(1, sizeof(tunnel));
+    int up_pipe[2], down_pipe[2];
+    if(!t || pipe2(up_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        free(t);
+        __atomic_sub_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if(pipe2(down_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        close(up_pipe[0]);
+        close(up_pipe[1]);
+        free(t);
+        __atomic_sub_fetch(&stats.active, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    fcntl(up_pipe[1], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+    fcntl(down_pipe[1], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+    
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(remote_fd, F_SETFL, fcntl(remote_fd, F_GETFL) | O_NONBLOCK);
+    
+    dir_init(&t->up, client_fd, remote_fd, up_pipe);
+    dir_init(&t->down, remote_fd, client_fd, down_pipe);
+    t->client.t = t;
+    t->client.fd = client_fd;
+    t->remote.t = t;
+    t->remote.fd = remote_fd;
+    t->started = t->last_active = time(NULL);
+    snprintf(t->target, sizeof(t->target), "%s", target);
+    __atomic_add_fetch(&stats.total, 1, __ATOMIC_RELAXED);
+    
+    relay *r = &relays[__atomic_fetch_add(&next_relay, 1, __ATOMIC_RELAXED) % relay_count];
+    pthread_mutex_lock(&r->lock);
+    t->next = r->pending;
+    r->pending = t;
+    pthread_mutex_unlock(&r->lock);
+    
+    uint64_t one = 1;
+    if(write(r->wakefd, &one, sizeof(one)) < 0) {
+        perror("Tunnel relay wakeup failed");
+    }
+    return 0;
+}
+
+void tunnel_set_limits(int max_tunnels, int idle_timeout) {
+    __atomic_store_n(&tunnel_max, max_tunnels, __ATOMIC_RELAXED);
+    __atomic_store_n(&tunnel_idle_timeout, idle_timeout, __ATOMIC_RELAXED);
+}
+
+void tunnel_get_stats(tunnel_stats *out) {
+    out->active = __atomic_load_n(&stats.active, __ATOMIC_RELAXED);
+    out->total = __atomic_load_n(&stats.total, __ATOMIC_RELAXED);
+    out->bytes_up = __atomic_load_n(&stats.bytes_up, __ATOMIC_RELAXED);
+    out->bytes_down = __atomic_load_n(&stats.bytes_down, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,29 @@
+#ifndef PROXY_TUNNEL_H
+#define PROXY_TUNNEL_H
+
+// CONNECT tunnels: after the handshake both sockets are handed to a small
+// pool of epoll relay threads that move bytes with splice(), so an idle or
+// long-lived tunnel costs file descriptors, not a blocked worker thread.
+
+#define MAX_TUNNELS 10000
+#define TUNNEL_IDLE_TIMEOUT 300     // seconds without traffic in either direction
+
+typedef struct tunnel_stats {
+    long active;
+    long total;
+    long long bytes_up;             // client -> origin
+    long long bytes_down;           // origin -> client
+} tunnel_stats;
+
+int tunnel_init(int relay_threads);
+void tunnel_set_limits(int max_tunnels, int idle_timeout);
+
+// Take a slot under max_tunnels before answering the CONNECT, so a client
+// over the limit can still be refused. tunnel_start() uses the slot, even
+// when it fails; tunnel_unreserve() gives it back if the tunnel never starts.
+int tunnel_reserve(void);
+void tunnel_unreserve(void);
+int tunnel_start(int client_fd, int remote_fd, const char *target);
+void tunnel_get_stats(tunnel_stats *stats);
+
+#endif // PROXY_TUNNEL_H
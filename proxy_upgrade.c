@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include "proxy_upgrade.h"
+#include "proxy_cache.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define UPGRADE_MAGIC 0x47505550        // "PUPG" little-endian
+
+// Sent along with the file descriptors: listeners first, then the admin
+// listener if has_admin is set
+typedef struct upgrade_hello {
+    uint32_t magic;
+    uint32_t listener_count;
+    uint32_t has_admin;
+} upgrade_hello;
+
+// One streamed cache entry: url, method and len response bytes follow.
+// A zero url_len ends the stream.
+typedef struct upgrade_entry {
+    uint32_t url_len;
+    uint32_t method_len;
+    uint32_t len;
+    int32_t stale_while_revalidate;
+    int32_t stale_if_error;
+    int32_t pad;
+    int64_t expires;
+} upgrade_entry;
+
+typedef struct upgrade_server {
+    int socket;
+    upgrade_sockets sockets;
+    void (*on_ready)(void);
+} upgrade_server;
+
+static int takeover_conn = -1;          // new side, until upgrade_ready()
+
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char*)buf;
+    while(len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = (char*)buf;
+    while(len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One line of at most len - 1 bytes, without the newline
+static int recv_line(int fd, char *out, size_t len) {
+    size_t n = 0;
+    while(n + 1 < len) {
+        char c;
+        if(recv_all(fd, &c, 1) < 0) return -1;
+        if(c == '\n') break;
+        out[n++] = c;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+static int send_sockets(int fd, const upgrade_sockets *sockets) {
+    int fds[UPGRADE_MAX_LISTENERS + 1];
+    int count = sockets->listener_count;
+    memcpy(fds, sockets->listeners, count * sizeof(int));
+    if(sockets->admin >= 0) fds[count++] = sockets->admin;
+    
+    upgrade_hello hello = { UPGRADE_MAGIC, sockets->listener_count, sockets->admin >= 0 };
+    struct iovec iov = { &hello, sizeof(hello) };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(hello) ? 0 : -1;
+}
+
+static int recv_sockets(int fd, upgrade_sockets *sockets) {
+    upgrade_hello hello;
+    struct iovec iov = { &hello, sizeof(hello) };
+    char control[CMSG_SPACE((UPGRADE_MAX_LISTENERS + 1) * sizeof(int))];
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(hello) || hello.magic != UPGRADE_MAGIC) {
+        return -1;
+    }
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+    
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[UPGRADE_MAX_LISTENERS + 1];
+    memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+    
+    if(hello.listener_count < 1 || count != (int)(hello.listener_count + (hello.has_admin ? 1 : 0))) {
+        for(int i = 0; i < count; i++) close(fds[i]);
+        return -1;
+    }
+    sockets->listener_count = hello.listener_count;
+    memcpy(sockets->listeners, fds, hello.listener_count * sizeof(int));
+    sockets->admin = hello.has_admin ? fds[count - 1] : -1;
+    return 0;
+}
+
+// Stream the hottest entries, coldest of them first, so the hottest lands
+// at the head of the new cache
+static void send_cache(int fd, long max_bytes) {
+    int count = 0;
+    cache_element **hot = max_bytes > 0 ? cache_pin_hottest(max_bytes, &count) : NULL;
+    
+    int i, failed = 0;
+    long bytes = 0;
+    for(i = count - 1; i >= 0 && !failed; i--) {
+        cache_element *e = hot[i];
+        upgrade_entry entry = { strlen(e->url), strlen(e->method), e->len,
+                                e->stale_while_revalidate, e->stale_if_error, 0, e->expires };
+        failed = send_all(fd, &entry, sizeof(entry)) < 0 ||
+                 send_all(fd, e->url, entry.url_len) < 0 ||
+                 send_all(fd, e->method, entry.method_len) < 0;
+        for(cache_chunk *c = e->chunks; c != NULL && !failed; c = c->next) {
+            failed = send_all(fd, c->data, c->len) < 0;
+        }
+        if(!failed) bytes += e->len;
+    }
+    for(i = 0; i < count; i++) cache_element_release(hot[i]);
+    free(hot);
+    
+    upgrade_entry end;
+    memset(&end, 0, sizeof(end));
+    if(!failed) send_all(fd, &end, sizeof(end));
+    if(max_bytes > 0) printf("Handed over %d cache entries (%ld bytes)\n", failed ? 0 : count, bytes);
+}
+
+static int recv_cache(int fd) {
+    int entries = 0;
+    long bytes = 0;
+    
+    for(;;) {
+        upgrade_entry entry;
+        if(recv_all(fd, &entry, sizeof(entry)) < 0) return -1;
+        if(entry.url_len == 0) break;
+        if(entry.url_len > 65536 || entry.method_len > 64) return -1;
+        
+        char *url = (char*)malloc(entry.url_len + 1);
+        char method[65];
+        if(!url || recv_all(fd, url, entry.url_len) < 0 ||
+           recv_all(fd, method, entry.method_len) < 0) {
+            free(url);
+            return -1;
+        }
+        url[entry.url_len] = '\0';
+        method[entry.method_len] = '\0';
+        
+        // Straight into exactly sized chunks, as the relay would leave them
+        cache_chunk *chunks = NULL, **tail = &chunks;
+        uint32_t off = 0;
+        int failed = 0;
+        do {
+            int len = entry.len - off < CACHE_CHUNK_SIZE ? (int)(entry.len - off) : CACHE_CHUNK_SIZE;
+            cache_chunk *chunk = (cache_chunk*)malloc(sizeof(cache_chunk) + len);
+            if(!chunk || recv_all(fd, chunk->data, len) < 0) {
+                free(chunk);
+                failed = 1;
+                break;
+            }
+            chunk->len = len;
+            chunk->next = NULL;
+            *tail = chunk;
+            tail = &chunk->next;
+            off += len;
+        } while(off < entry.len);
+        
+        cache_element *e = failed ? NULL :
+            add_cache_element_chunks(chunks, entry.len, url, method, entry.expires,
+                                     entry.stale_while_revalidate, entry.stale_if_error);
+        if(e) {
+            cache_element_release(e);
+            entries++;
+            bytes += entry.len;
+        } else {
+            cache_chunks_free(chunks);
+        }
+        free(url);
+        if(failed) return -1;
+    }
+    
+    printf("Took over %d cache entries (%ld bytes)\n", entries, bytes);
+    return 0;
+}
+
+// Only the same user (or root) may take the listeners over
+static int peer_allowed(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return 0;
+    return cred.uid == getuid() || cred.uid == 0;
+}
+
+static void *upgrade_loop(void *arg) {
+    upgrade_server *server = (upgrade_server*)arg;
+    
+    for(;;) {
+        int fd = accept(server->socket, NULL, NULL);
+        if(fd < 0) {
+            if(errno != EINTR) perror("Upgrade accept failed");
+            continue;
+        }
+        
+        char request[64];
+        long cache_bytes = 0;
+        if(!peer_allowed(fd) || recv_line(fd, request, sizeof(request)) < 0 ||
+           sscanf(request, "TAKEOVER %ld", &cache_bytes) != 1) {
+            printf("Rejected upgrade request\n");
+            close(fd);
+            continue;
+        }
+        
+        printf("New process is taking over the listeners\n");
+        char reply[16] = "";
+        if(send_sockets(fd, &server->sockets) == 0) {
+            send_cache(fd, cache_bytes);
+            recv_line(fd, reply, sizeof(reply));
+        }
+        close(fd);
+        
+        if(strcmp(reply, "READY") != 0) {
+            printf("Upgrade aborted by the new process, still serving\n");
+            continue;
+        }
+        close(server->socket);
+        server->on_ready();
+        return NULL;
+    }
+}
+
+int upgrade_serve(const char *path, const upgrade_sockets *sockets, void (*on_ready)(void)) {
+    if(!path || !path[0]) return 0;
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        printf("upgrade_socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    upgrade_server *server = (upgrade_server*)malloc(sizeof(upgrade_server));
+    if(!server) return -1;
+    server->sockets = *sockets;
+    server->on_ready = on_ready;
+    server->socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    
+    // Whoever bound the path before (an old process, or a stale file) is
+    // replaced; the socket itself is only usable by this user
+    unlink(path);
+    mode_t mask = umask(077);
+    int bound = server->socket >= 0 && bind(server->socket, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if(!bound || listen(server->socket, 4) < 0) {
+        perror("Upgrade socket is not available");
+        if(server->socket >= 0) close(server->socket);
+        free(server);
+        return -1;
+    }
+    
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, upgrade_loop, server) != 0) {
+        close(server->socket);
+        free(server);
+        return -1;
+    }
+    pthread_detach(tid);
+    
+    printf("Accepting hot restarts on %s\n", path);
+    return 0;
+}
+
+int upgrade_takeover(const char *path, upgrade_sockets *sockets, long cache_bytes) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(!path || !path[0] || strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Taking over needs upgrade_socket set to the running proxy's\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("No running proxy to take over from");
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    
+    char request[64];
+    int len = snprintf(request, sizeof(request), "TAKEOVER %ld\n", cache_bytes);
+    if(send_all(fd, request, len) < 0 || recv_sockets(fd, sockets) < 0) {
+        printf("Failed to receive listening sockets from %s\n", path);
+        close(fd);
+        return -1;
+    }
+    printf("Took over %d listening sockets%s\n", sockets->listener_count,
+           sockets->admin >= 0 ? " and the admin API" : "");
+    
+    // A broken stream only costs the warm start
+    if(recv_cache(fd) < 0) printf("Cache handover failed, starting with what arrived\n");
+    
+    takeover_conn = fd;
+    return 0;
+}
+
+void upgrade_ready(void) {
+    if(takeover_conn < 0) return;
+    send_all(takeover_conn, "READY\n", 6);
+    close(takeover_conn);
+    takeover_conn = -1;
+}
@@ -0,0 +1,30 @@
+#ifndef PROXY_UPGRADE_H
+#define PROXY_UPGRADE_H
+
+// Hot restart. A running proxy with upgrade_socket set listens on that Unix
+// socket path. A new binary started with -U connects there and receives the
+// listening sockets with SCM_RIGHTS; the connections queued in their
+// backlogs come with them. It can also ask for the old process's most-hit
+// cache entries, streamed over the same connection. Once the new process
+// is accepting it reports READY: the old one stops accepting, lets its
+// in-flight requests and tunnels finish within drain_timeout, and exits.
+// If the new process fails before READY, the old one just carries on.
+
+#define UPGRADE_MAX_LISTENERS 240       // SCM_RIGHTS passes at most 253 fds
+
+typedef struct upgrade_sockets {
+    int listeners[UPGRADE_MAX_LISTENERS];
+    int listener_count;
+    int admin;                          // admin API listener, -1 if none
+} upgrade_sockets;
+
+// Old side: serve takeover requests on path for sockets. on_ready runs
+// once a new process has taken over and is accepting.
+int upgrade_serve(const char *path, const upgrade_sockets *sockets, void (*on_ready)(void));
+
+// New side: take over sockets (and up to cache_bytes of cached responses)
+// from the proxy serving path, then call upgrade_ready() once accepting
+int upgrade_takeover(const char *path, upgrade_sockets *sockets, long cache_bytes);
+void upgrade_ready(void);
+
+#endif // PROXY_UPGRADE_H
@@ -0,0 +1,280 @@
+#include "proxy_uring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_POOL_ENTRIES 8
+#define URING_MAX_POOLED 64
+
+static uring *pool;
+static int pooled;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Probe once: ring setup must work and every opcode the proxy uses must exist
+int uring_supported() {
+    static int supported = -1;
+    if(supported >= 0) return supported;
+    
+    supported = 0;
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = sys_io_uring_setup(4, &params);
+    if(fd < 0) return 0;
+    
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, probe_len);
+    if(probe && sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+       (params.features & IORING_FEAT_EXT_ARG) && (params.features & IORING_FEAT_NODROP)) {
+        int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                      IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_ASYNC_CANCEL };
+        supported = 1;
+        for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = 0;
+            }
+        }
+    }
+    free(probe);
+    close(fd);
+    return supported;
+}
+
+int uring_init(uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if(ring->fd < 0) return -1;
+    
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED) goto fail;
+    
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED) goto fail;
+    }
+    
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) goto fail;
+    
+    char *sq = (char*)ring->sq_ptr;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    
+    char *cq = (char*)ring->cq_ptr;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+    
+fail:
+    uring_destroy(ring);
+    return -1;
+}
+
+void uring_destroy(uring *ring) {
+    if(ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+    if(ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if(ring->sq_ptr && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+    if(ring->fd >= 0) close(ring->fd);
+    free(ring->arena);
+    ring->fd = -1;
+    ring->sqes = NULL;
+    ring->sq_ptr = ring->cq_ptr = NULL;
+    ring->arena = NULL;
+}
+
+uring *uring_pool_get(size_t arena_len) {
+    pthread_mutex_lock(&pool_lock);
+    uring *ring = pool;
+    if(ring) {
+        pool = ring->next_free;
+        pooled--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    
+    if(ring && ring->arena_len >= arena_len) return ring;
+    if(ring) {
+        // Window grew since this ring was set up
+        uring_destroy(ring);
+        free(ring);
+    }
+    
+    ring = (uring*)malloc(sizeof(uring));
+    if(!ring) return NULL;
+    if(uring_init(ring, URING_POOL_ENTRIES) < 0) {
+        free(ring);
+        return NULL;
+    }
+    
+    ring->arena = (char*)malloc(arena_len);
+    struct iovec iov = { ring->arena, arena_len };
+    if(!ring->arena || sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        uring_destroy(ring);
+        free(ring);
+        return NULL;
+    }
+    ring->arena_len = arena_len;
+    return ring;
+}
+
+void uring_pool_put(uring *ring) {
+    if(!ring) return;
+    
+    pthread_mutex_lock(&pool_lock);
+    if(pooled < URING_MAX_POOLED) {
+        ring->next_free = pool;
+        pool = ring;
+        pooled++;
+        ring = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    
+    if(ring) {
+        uring_destroy(ring);
+        free(ring);
+    }
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if(ring->sq_local_tail - head >= *ring->sq_mask + 1) return NULL;
+    
+    unsigned idx = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Submit everything queued and wait for wait_nr completions, at most
+// timeout_ms (-1 = forever). One syscall either way.
+int uring_enter(uring *ring, unsigned wait_nr, int timeout_ms) {
+    unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if(timeout_ms >= 0 && wait_nr) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (unsigned long long)(uintptr_t)&ts;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+    
+    int ret = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof(arg));
+    if(ret < 0 && (errno == ETIME || errno == EINTR)) return 0;
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring *ring) {
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, unsigned long long user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long user_data) {
+    uring_prep_accept(sqe, fd, user_data);
+    sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+}
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, unsigned long long user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, unsigned long long user_data) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, unsigned long long user_data) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->off = (unsigned long long)-1;     // sockets have no file position
+    sqe->buf_index = 0;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, unsigned long long user_data) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    sqe->off = (unsigned long long)-1;
+    sqe->buf_index = 0;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long long target, unsigned long long user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
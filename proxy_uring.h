@@ -0,0 +1,56 @@
+#ifndef PROXY_URING_H
+#define PROXY_URING_H
+
+// Minimal io_uring wrapper on the raw syscalls (no liburing dependency).
+// Rings are pooled because workers are per-connection threads: setting up
+// a ring and registering its buffer per request would cost more syscalls
+// than it saves.
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+typedef struct uring uring;
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sq_local_tail;         // SQEs handed out but not yet submitted
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    char *arena;                    // registered as fixed buffer 0
+    size_t arena_len;
+    uring *next_free;
+};
+
+int uring_supported();
+int uring_init(uring *ring, unsigned entries);
+void uring_destroy(uring *ring);
+
+// Pool of rings with a registered arena of at least arena_len bytes
+uring *uring_pool_get(size_t arena_len);
+void uring_pool_put(uring *ring);
+
+struct io_uring_sqe *uring_get_sqe(uring *ring);
+int uring_enter(uring *ring, unsigned wait_nr, int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(uring *ring);
+void uring_cqe_seen(uring *ring);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long user_data);
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, unsigned long long user_data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, unsigned long long user_data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, unsigned long long user_data);
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, unsigned long long user_data);
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, unsigned long long user_data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long long target, unsigned long long user_data);
+
+#endif // PROXY_URING_H
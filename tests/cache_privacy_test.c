@@ -0,0 +1,195 @@
+// Responses to one user must not be served to another
+//
+// Usage: tests/cache_privacy_test [proxy_binary]    (default ./proxy)
+//
+// Starts an origin that answers every request with the credentials it saw
+// (Authorization, Cookie or X-User) in the body, cacheable for a minute,
+// and a proxy in front of it. Each case sends a request as alice and then
+// as someone else; the second must never get alice's body. Responses the
+// origin marks public may be shared and must come from the cache.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ORIGIN_PORT 18183
+#define PROXY_PORT 18182
+
+static int origin_hits;
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("origin listen");
+        exit(1);
+    }
+    return fd;
+}
+
+// Value of header name in the request head, "anonymous" if absent
+static void header_value(const char *head, const char *name, char *out, size_t out_len) {
+    size_t name_len = strlen(name);
+    for(const char *line = strstr(head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        const char *h = line + 2;
+        if(strncasecmp(h, name, name_len) == 0 && h[name_len] == ':') {
+            h += name_len + 1;
+            while(*h == ' ') h++;
+            snprintf(out, out_len, "%.*s", (int)strcspn(h, "\r\n"), h);
+            return;
+        }
+    }
+    snprintf(out, out_len, "anonymous");
+}
+
+static void *origin_loop(void *arg) {
+    int listen_fd = (int)(long)arg;
+    
+    for(;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) continue;
+        
+        char buf[4096];
+        int len = 0, n;
+        buf[0] = '\0';
+        while(len < (int)sizeof(buf) - 1 && (n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0) {
+            len += n;
+            buf[len] = '\0';
+            if(strstr(buf, "\r\n\r\n")) break;
+        }
+        __atomic_fetch_add(&origin_hits, 1, __ATOMIC_RELAXED);
+        
+        // /auth, /public: Authorization; /cookie: Cookie; /vary: X-User
+        const char *path = strchr(buf, ' ');
+        path = path ? path + 1 : "";
+        char user[256], body[300], reply[1024];
+        const char *cc = "max-age=60", *vary = "";
+        if(strncmp(path, "/cookie", 7) == 0) {
+            header_value(buf, "Cookie", user, sizeof(user));
+        } else if(strncmp(path, "/vary", 5) == 0) {
+            header_value(buf, "X-User", user, sizeof(user));
+            vary = "Vary: Accept-Encoding, X-User\r\n";
+        } else {
+            header_value(buf, "Authorization", user, sizeof(user));
+            if(strncmp(path, "/public", 7) == 0) cc = "public, max-age=60";
+        }
+        
+        int body_len = snprintf(body, sizeof(body), "user=%s", user);
+        snprintf(reply, sizeof(reply), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n"
+                 "Cache-Control: %s\r\n%sConnection: close\r\n\r\n%s", body_len, cc, vary, body);
+        send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+        close(fd);
+    }
+    return NULL;
+}
+
+// One request through the proxy with an extra header line (or ""); the
+// whole response in out
+static int proxy_get(const char *path, const char *header, char *out, size_t out_len) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PROXY_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    char request[512];
+    snprintf(request, sizeof(request), "GET http://127.0.0.1:%d%s HTTP/1.1\r\n"
+             "Host: 127.0.0.1:%d\r\n%s\r\n", ORIGIN_PORT, path, ORIGIN_PORT, header);
+    send(fd, request, strlen(request), MSG_NOSIGNAL);
+    
+    size_t len = 0;
+    ssize_t n;
+    while(len < out_len - 1 && (n = recv(fd, out + len, out_len - 1 - len, 0)) > 0) len += n;
+    out[len] = '\0';
+    close(fd);
+    return 0;
+}
+
+static int failures;
+
+// alice fetches path, then other must not see her response
+static void check_private(const char *name, const char *path, const char *alice, const char *other) {
+    char response[4096];
+    proxy_get(path, alice, response, sizeof(response));
+    if(!strstr(response, "alice")) {
+        printf("FAIL: %s: alice did not get her own response:\n%s\n", name, response);
+        failures++;
+    }
+    proxy_get(path, other, response, sizeof(response));
+    if(strstr(response, "alice")) {
+        printf("FAIL: %s: alice's response served to another client:\n%s\n", name, response);
+        failures++;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *proxy = argc > 1 ? argv[1] : "./proxy";
+    signal(SIGPIPE, SIG_IGN);
+    
+    pthread_t tid;
+    pthread_create(&tid, NULL, origin_loop, (void*)(long)listen_on(ORIGIN_PORT));
+    
+    char port[16];
+    snprintf(port, sizeof(port), "%d", PROXY_PORT);
+    pid_t pid = fork();
+    if(pid == 0) {
+        if(!freopen("/dev/null", "w", stdout)) _exit(127);
+        execl(proxy, proxy, port, (char*)NULL);
+        perror(proxy);
+        _exit(127);
+    }
+    
+    char response[4096];
+    int up = 0;
+    for(int i = 0; i < 50 && !up; i++) {
+        usleep(100000);
+        up = proxy_get("/ping", "", response, sizeof(response)) == 0;
+    }
+    if(!up) {
+        printf("FAIL: proxy did not start\n");
+        failures++;
+    }
+    
+    if(up) {
+        check_private("Authorization, anonymous", "/auth1", "Authorization: Bearer alice\r\n", "");
+        check_private("Authorization, other user", "/auth2", "Authorization: Bearer alice\r\n",
+                      "Authorization: Bearer bob\r\n");
+        check_private("Cookie", "/cookie", "Cookie: sid=alice\r\n", "");
+        check_private("Vary", "/vary", "X-User: alice\r\n", "X-User: bob\r\n");
+        
+        // Marked public: shared, so the second request is a cache hit
+        proxy_get("/public", "Authorization: Bearer alice\r\n", response, sizeof(response));
+        int before = __atomic_load_n(&origin_hits, __ATOMIC_RELAXED);
+        proxy_get("/public", "", response, sizeof(response));
+        if(__atomic_load_n(&origin_hits, __ATOMIC_RELAXED) != before || !strstr(response, "alice")) {
+            printf("FAIL: public response to an authorized request was not cached\n");
+            failures++;
+        }
+    }
+    
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    
+    printf("%s: cache_privacy_test\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+// Stale-if-error across background refreshes
+//
+// Usage: tests/stale_if_error_test [proxy_binary]    (default ./proxy)
+//
+// Starts an origin that answers 200 (max-age=1, stale-while-revalidate=30,
+// stale-if-error=600) once and 500 after that, and a proxy in front of it.
+// Once the copy goes stale every request starts a background refresh that
+// gets the 500; the client must keep getting the good body, never the error.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ORIGIN_PORT 18181
+#define PROXY_PORT 18180
+#define GOOD_BODY "good body"
+
+static int origin_hits;
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("origin listen");
+        exit(1);
+    }
+    return fd;
+}
+
+static void *origin_loop(void *arg) {
+    int listen_fd = (int)(long)arg;
+    
+    for(;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) continue;
+        
+        char buf[4096];
+        int len = 0, n;
+        while(len < (int)sizeof(buf) - 1 && (n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0) {
+            len += n;
+            buf[len] = '\0';
+            if(strstr(buf, "\r\n\r\n")) break;
+        }
+        
+        const char *reply = __atomic_fetch_add(&origin_hits, 1, __ATOMIC_RELAXED) == 0 ?
+            "HTTP/1.1 200 OK\r\nContent-Length: 9\r\n"
+            "Cache-Control: max-age=1, stale-while-revalidate=30, stale-if-error=600\r\n"
+            "Connection: close\r\n\r\n" GOOD_BODY :
+            "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 5\r\n"
+            "Connection: close\r\n\r\nerror";
+        send(fd, reply, strlen(reply), MSG_NOSIGNAL);
+        close(fd);
+    }
+    return NULL;
+}
+
+// One request through the proxy; the whole response in out
+static int proxy_get(char *out, size_t out_len) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(PROXY_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    char request[256];
+    snprintf(request, sizeof(request), "GET http://127.0.0.1:%d/item HTTP/1.1\r\n"
+             "Host: 127.0.0.1:%d\r\n\r\n", ORIGIN_PORT, ORIGIN_PORT);
+    send(fd, request, strlen(request), MSG_NOSIGNAL);
+    
+    size_t len = 0;
+    ssize_t n;
+    while(len < out_len - 1 && (n = recv(fd, out + len, out_len - 1 - len, 0)) > 0) len += n;
+    out[len] = '\0';
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *proxy = argc > 1 ? argv[1] : "./proxy";
+    signal(SIGPIPE, SIG_IGN);
+    
+    pthread_t tid;
+    pthread_create(&tid, NULL, origin_loop, (void*)(long)listen_on(ORIGIN_PORT));
+    
+    char port[16];
+    snprintf(port, sizeof(port), "%d", PROXY_PORT);
+    pid_t pid = fork();
+    if(pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        execl(proxy, proxy, port, (char*)NULL);
+        perror(proxy);
+        _exit(127);
+    }
+    
+    char response[4096];
+    int up = 0;
+    for(int i = 0; i < 50 && !up; i++) {
+        usleep(100000);
+        up = proxy_get(response, sizeof(response)) == 0;
+    }
+    
+    int failures = 0;
+    if(!up || !strstr(response, GOOD_BODY)) {
+        printf("FAIL: first request did not get the origin's 200\n");
+        failures++;
+    }
+    
+    // Stale from here on: each request is served stale and refreshes
+    sleep(2);
+    for(int i = 0; i < 3 && up; i++) {
+        if(proxy_get(response, sizeof(response)) < 0 || !strstr(response, GOOD_BODY)) {
+            printf("FAIL: request %d after expiry did not get the stale copy:\n%s\n", i + 1, response);
+            failures++;
+        }
+        usleep(500000);
+    }
+    
+    int hits = __atomic_load_n(&origin_hits, __ATOMIC_RELAXED);
+    if(hits < 2) {
+        printf("FAIL: no background refresh reached the origin\n");
+        failures++;
+    }
+    
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    
+    printf("%s: stale_if_error_test (%d origin requests)\n", failures ? "FAIL" : "PASS", hits);
+    return failures ? 1 : 0;
+}
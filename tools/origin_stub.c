@@ -0,0 +1,116 @@
+// Origin stub for replaying captured traffic
+//
+// Usage: origin_stub [-d delay_ms] port
+//
+// Answers GET /r/<bytes>/<status>/... with that status and a response of
+// <bytes> total (headers included, as recorded by the proxy's capture), so
+// replayed requests see the sizes they saw in production. tools/replay
+// rewrites captured keys into this form. -d adds a fixed think time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define STUB_REQUEST_MAX 8192
+#define STUB_FILL (64*1024)
+
+static char fill[STUB_FILL];
+static int delay_ms;
+
+static void *stub_conn(void *arg) {
+    int fd = (int)(long)arg;
+    char buf[STUB_REQUEST_MAX];
+    int len = 0;
+    
+    while(len < STUB_REQUEST_MAX - 1) {
+        int n = recv(fd, buf + len, STUB_REQUEST_MAX - 1 - len, 0);
+        if(n <= 0) break;
+        len += n;
+        buf[len] = '\0';
+        if(strstr(buf, "\r\n\r\n")) break;
+    }
+    buf[len] = '\0';
+    
+    long long bytes = 0;
+    int status = 404;
+    char *path = strchr(buf, ' ');
+    if(path && sscanf(path + 1, "/r/%lld/%d/", &bytes, &status) != 2) {
+        bytes = 0;
+        status = 404;
+    }
+    if(status < 100 || status > 999) status = 502;
+    if(delay_ms > 0) usleep(delay_ms * 1000);
+    
+    // Size the body so headers + body match the recorded response size.
+    // Content-Length's own digits change the header length, so settle it
+    // in a few rounds; the header always matches the body actually sent.
+    char head[256];
+    long long body = 0;
+    int head_len = 0;
+    for(int round = 0; round < 4; round++) {
+        head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 %d Replay\r\nContent-Type: application/octet-stream\r\n"
+                            "Content-Length: %lld\r\nConnection: close\r\n\r\n", status, body);
+        long long want = bytes > head_len ? bytes - head_len : 0;
+        if(want == body || round == 3) break;
+        body = want;
+    }
+    
+    send(fd, head, head_len, MSG_NOSIGNAL);
+    while(body > 0) {
+        int chunk = body < STUB_FILL ? (int)body : STUB_FILL;
+        int n = send(fd, fill, chunk, MSG_NOSIGNAL);
+        if(n <= 0) break;
+        body -= n;
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "d:")) != -1) {
+        if(opt == 'd') delay_ms = atoi(optarg);
+        else {
+            fprintf(stderr, "Usage: %s [-d delay_ms] port\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-d delay_ms] port\n", argv[0]);
+        return 1;
+    }
+    
+    memset(fill, 'x', sizeof(fill));
+    signal(SIGPIPE, SIG_IGN);
+    
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[optind]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 1024) < 0) {
+        perror("Origin stub bind failed");
+        return 1;
+    }
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    for(;;) {
+        int fd = accept(sock, NULL, NULL);
+        if(fd < 0) continue;
+        pthread_t tid;
+        if(pthread_create(&tid, &attr, stub_conn, (void*)(long)fd) != 0) close(fd);
+    }
+}
@@ -0,0 +1,269 @@
+// Replay a traffic capture (capture_file) against a running proxy
+//
+// Usage: replay [-p proxy_host:port] [-o stub_host:port] [-s speed]
+//               [-c connections] capture.jsonl
+//
+// Requests are issued at their captured start offsets divided by -s
+// (1 = original pacing, 2 = twice as fast, 0 = back to back), each on its
+// own connection, with at most -c in flight. Captured keys are rewritten
+// to http://<stub>/r/<bytes>/<status>/<key host>/<key path> so that
+// tools/origin_stub answers with the recorded status and size, while
+// distinct captured keys stay distinct cache keys in the proxy.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define REPLAY_LINE_MAX 4096
+#define REPLAY_URL_MAX 512
+
+typedef struct replay_req {
+    long long t_us;
+    char method[16];
+    char url[REPLAY_URL_MAX];
+    long long bytes;                // recorded response size
+    long long got;                  // bytes received on replay
+    long long lag_us;               // how late it was issued
+    long long latency_us;
+    int ok;
+} replay_req;
+
+static replay_req *reqs;
+static int req_count;
+static int next_req;                // next request a worker may take
+static int released;                // requests whose start time has come
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct sockaddr_in proxy_addr;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Pull "name":<number> or "name":"<string>" out of one capture line
+static int json_field(const char *line, const char *name, char *out, size_t out_len) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", name);
+    const char *p = strstr(line, pattern);
+    if(!p) return -1;
+    p += strlen(pattern);
+    
+    size_t n = 0;
+    if(*p == '"') {
+        for(p++; *p && *p != '"' && n + 1 < out_len; p++) out[n++] = *p;
+    } else {
+        for(; *p && *p != ',' && *p != '}' && n + 1 < out_len; p++) out[n++] = *p;
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+static int cmp_start(const void *a, const void *b) {
+    long long x = ((const replay_req*)a)->t_us, y = ((const replay_req*)b)->t_us;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int load_capture(const char *path, const char *stub) {
+    FILE *fp = fopen(path, "r");
+    if(!fp) {
+        perror(path);
+        return -1;
+    }
+    
+    int capacity = 0;
+    char line[REPLAY_LINE_MAX];
+    while(fgets(line, sizeof(line), fp)) {
+        char t[32], method[16], key[256], status[16], bytes[32];
+        if(json_field(line, "t_us", t, sizeof(t)) < 0 ||
+           json_field(line, "method", method, sizeof(method)) < 0 ||
+           json_field(line, "key", key, sizeof(key)) < 0 ||
+           json_field(line, "status", status, sizeof(status)) < 0 ||
+           json_field(line, "bytes", bytes, sizeof(bytes)) < 0) {
+            continue;
+        }
+        
+        if(req_count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            replay_req *grown = realloc(reqs, capacity * sizeof(replay_req));
+            if(!grown) break;
+            reqs = grown;
+        }
+        
+        replay_req *r = &reqs[req_count++];
+        memset(r, 0, sizeof(*r));
+        r->t_us = atoll(t);
+        r->bytes = atoll(bytes);
+        snprintf(r->method, sizeof(r->method), "%s", method);
+        
+        // Errors recorded as status 0 (nothing sent) replay as a 502
+        int code = atoi(status);
+        const char *rest = strncmp(key, "http://", 7) == 0 ? key + 7 : key;
+        snprintf(r->url, sizeof(r->url), "http://%s/r/%lld/%d/%s", stub, r->bytes,
+                 code ? code : 502, rest);
+    }
+    fclose(fp);
+    
+    qsort(reqs, req_count, sizeof(replay_req), cmp_start);
+    return 0;
+}
+
+static void run_request(replay_req *r) {
+    long long start = now_us();
+    
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return;
+    if(connect(fd, (struct sockaddr*)&proxy_addr, sizeof(proxy_addr)) < 0) {
+        close(fd);
+        return;
+    }
+    
+    char request[REPLAY_URL_MAX + 128];
+    int len = snprintf(request, sizeof(request), "%s %s HTTP/1.1\r\nContent-Length: 0\r\n\r\n",
+                       r->method, r->url);
+    if(send(fd, request, len, MSG_NOSIGNAL) != len) {
+        close(fd);
+        return;
+    }
+    
+    char buf[64 * 1024];
+    int n;
+    while((n = recv(fd, buf, sizeof(buf), 0)) > 0) r->got += n;
+    close(fd);
+    
+    r->latency_us = now_us() - start;
+    r->ok = n == 0 && r->got > 0;
+}
+
+static void *replay_worker(void *arg) {
+    (void)arg;
+    
+    for(;;) {
+        pthread_mutex_lock(&queue_lock);
+        while(next_req < req_count && next_req >= released) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        if(next_req >= req_count) {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+        replay_req *r = &reqs[next_req++];
+        pthread_mutex_unlock(&queue_lock);
+        
+        run_request(r);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p proxy_host:port] [-o stub_host:port] [-s speed] "
+            "[-c connections] capture.jsonl\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *proxy = "127.0.0.1:8080";
+    const char *stub = "127.0.0.1:9900";
+    double speed = 1.0;
+    int connections = 64;
+    
+    int opt;
+    while((opt = getopt(argc, argv, "p:o:s:c:")) != -1) {
+        switch(opt) {
+            case 'p': proxy = optarg; break;
+            case 'o': stub = optarg; break;
+            case 's': speed = atof(optarg); break;
+            case 'c': connections = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || connections < 1 || speed < 0) usage(argv[0]);
+    
+    const char *colon = strrchr(proxy, ':');
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    char host[64];
+    snprintf(host, sizeof(host), "%.*s", colon ? (int)(colon - proxy) : 0, proxy);
+    if(!colon || inet_pton(AF_INET, host, &proxy_addr.sin_addr) != 1) usage(argv[0]);
+    proxy_addr.sin_port = htons(atoi(colon + 1));
+    
+    if(load_capture(argv[optind], stub) < 0) return 1;
+    if(req_count == 0) {
+        printf("No requests in capture\n");
+        return 0;
+    }
+    
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    int started = 0;
+    for(; threads && started < connections; started++) {
+        if(pthread_create(&threads[started], NULL, replay_worker, NULL) != 0) break;
+    }
+    if(started == 0) {
+        fprintf(stderr, "Failed to start replay threads\n");
+        return 1;
+    }
+    
+    // Release each request at its scaled start time
+    long long base = now_us(), first = reqs[0].t_us;
+    for(int i = 0; i < req_count; i++) {
+        long long due = speed > 0 ? base + (long long)((reqs[i].t_us - first) / speed) : base;
+        long long wait = due - now_us();
+        if(wait > 0) usleep(wait);
+        reqs[i].lag_us = now_us() - due;
+        
+        pthread_mutex_lock(&queue_lock);
+        released = i + 1;
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    pthread_mutex_lock(&queue_lock);
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    
+    for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    double elapsed = (now_us() - base) / 1e6;
+    
+    int ok = 0, mismatched = 0;
+    long long *latency = malloc(req_count * sizeof(long long));
+    int n = 0;
+    for(int i = 0; i < req_count; i++) {
+        if(!reqs[i].ok) continue;
+        ok++;
+        if(reqs[i].got != reqs[i].bytes) mismatched++;
+        latency[n++] = reqs[i].latency_us;
+    }
+    
+    printf("requests     %d in %.2fs (%.1f/s), speed %.2gx, %d connections\n",
+           req_count, elapsed, req_count / elapsed, speed, started);
+    printf("completed    %d, failed %d, size differs from capture %d\n",
+           ok, req_count - ok, mismatched);
+    if(n > 0) {
+        qsort(latency, n, sizeof(long long), cmp_ll);
+        printf("latency ms   p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+               latency[n / 2] / 1000.0, latency[(int)(n * 0.9)] / 1000.0,
+               latency[(int)(n * 0.99)] / 1000.0, latency[n - 1] / 1000.0);
+    }
+    
+    // Schedule slip: a replay that cannot keep pace is not the captured load
+    for(int i = 0; i < req_count; i++) latency[i] = reqs[i].lag_us;
+    qsort(latency, req_count, sizeof(long long), cmp_ll);
+    printf("issue lag ms p50 %.2f  p99 %.2f\n", latency[req_count / 2] / 1000.0,
+           latency[(int)(req_count * 0.99)] / 1000.0);
+    
+    free(latency);
+    free(threads);
+    free(reqs);
+    return 0;
+}
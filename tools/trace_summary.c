@@ -0,0 +1,138 @@
+// Summarize a binary trace file written by the proxy (trace_file)
+//
+// Usage: trace_summary [-n slowest] trace.bin
+//
+// Prints request counts by outcome, p50/p90/p99/max per phase over the
+// requests that reached it, and the slowest requests with their phases.
+
+#include "../proxy_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_total_desc(const void *a, const void *b) {
+    uint32_t x = ((const trace_record*)a)->mark_us[TRACE_DONE];
+    uint32_t y = ((const trace_record*)b)->mark_us[TRACE_DONE];
+    return x > y ? -1 : x < y;
+}
+
+// Sorted values -> percentile in milliseconds
+static double percentile_ms(uint32_t *sorted, size_t n, double p) {
+    size_t idx = (size_t)(p * (n - 1) + 0.5);
+    return sorted[idx] / 1000.0;
+}
+
+static void print_row(const char *name, uint32_t *values, size_t n, size_t total) {
+    if(n == 0) {
+        printf("%-10s %8zu\n", name, n);
+        return;
+    }
+    qsort(values, n, sizeof(uint32_t), cmp_u32);
+    printf("%-10s %8zu %6.1f%% %10.2f %10.2f %10.2f %10.2f\n", name, n, 100.0 * n / total,
+           percentile_ms(values, n, 0.50), percentile_ms(values, n, 0.90),
+           percentile_ms(values, n, 0.99), values[n - 1] / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+    int slowest = 10;
+    int opt;
+    while((opt = getopt(argc, argv, "n:")) != -1) {
+        if(opt == 'n') slowest = atoi(optarg);
+        else {
+            fprintf(stderr, "Usage: %s [-n slowest] trace_file\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-n slowest] trace_file\n", argv[0]);
+        return 1;
+    }
+    
+    FILE *fp = fopen(argv[optind], "rb");
+    if(!fp) {
+        perror(argv[optind]);
+        return 1;
+    }
+    
+    trace_file_header header;
+    if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRACE_MAGIC ||
+       header.version != TRACE_VERSION || header.record_size != sizeof(trace_record) ||
+       header.phases != TRACE_PHASES) {
+        fprintf(stderr, "%s: not a trace file from this proxy version\n", argv[optind]);
+        fclose(fp);
+        return 1;
+    }
+    
+    size_t count = 0, capacity = 0;
+    trace_record *records = NULL;
+    for(;;) {
+        if(count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            trace_record *grown = realloc(records, capacity * sizeof(trace_record));
+            if(!grown) {
+                fprintf(stderr, "Out of memory after %zu records\n", count);
+                break;
+            }
+            records = grown;
+        }
+        if(fread(&records[count], sizeof(trace_record), 1, fp) != 1) break;
+        count++;
+    }
+    fclose(fp);
+    
+    if(count == 0) {
+        printf("No records\n");
+        free(records);
+        return 0;
+    }
+    
+    size_t outcomes[TRACE_OUTCOMES] = { 0 };
+    for(size_t i = 0; i < count; i++) {
+        if(records[i].outcome < TRACE_OUTCOMES) outcomes[records[i].outcome]++;
+    }
+    printf("%zu requests:", count);
+    for(int i = 0; i < TRACE_OUTCOMES; i++) printf(" %s=%zu", trace_outcome_names[i], outcomes[i]);
+    printf("\n\n");
+    
+    uint32_t *values = malloc(count * sizeof(uint32_t));
+    if(!values) {
+        free(records);
+        return 1;
+    }
+    
+    printf("%-10s %8s %7s %10s %10s %10s %10s\n", "phase (ms)", "reached", "", "p50", "p90", "p99", "max");
+    for(int phase = 0; phase < TRACE_PHASES; phase++) {
+        size_t n = 0;
+        for(size_t i = 0; i < count; i++) {
+            if(records[i].mark_us[phase]) values[n++] = trace_phase_us(&records[i], phase);
+        }
+        print_row(trace_phase_names[phase], values, n, count);
+    }
+    size_t n = 0;
+    for(size_t i = 0; i < count; i++) values[n++] = records[i].mark_us[TRACE_DONE];
+    print_row("total", values, n, count);
+    free(values);
+    
+    if(slowest > 0) {
+        qsort(records, count, sizeof(trace_record), cmp_total_desc);
+        printf("\nSlowest %d:\n", slowest < (int)count ? slowest : (int)count);
+        for(size_t i = 0; i < count && (int)i < slowest; i++) {
+            trace_record *t = &records[i];
+            printf("%9.1fms %-6s %s %s", t->mark_us[TRACE_DONE] / 1000.0,
+                   t->outcome < TRACE_OUTCOMES ? trace_outcome_names[t->outcome] : "?", t->method, t->url);
+            for(int phase = 0; phase < TRACE_PHASES; phase++) {
+                if(t->mark_us[phase]) printf(" %s=%.1f", trace_phase_names[phase], trace_phase_us(t, phase) / 1000.0);
+            }
+            printf("\n");
+        }
+    }
+    
+    free(records);
+    return 0;
+}